@@ -16,4 +16,14 @@ typedef GMutex janus_mutex;
 #define janus_mutex_unlock(a) g_mutex_unlock(a)
 #define janus_mutex_clear(a) g_mutex_clear(a)
 
+/* Condition wrapper */
+typedef GCond janus_condition;
+
+#define janus_condition_init(a) g_cond_init(a)
+#define janus_condition_wait(a, b) g_cond_wait(a, b)
+#define janus_condition_wait_until(a, b, c) g_cond_wait_until(a, b, c)
+#define janus_condition_signal(a) g_cond_signal(a)
+#define janus_condition_broadcast(a) g_cond_broadcast(a)
+#define janus_condition_clear(a) g_cond_clear(a)
+
 #endif
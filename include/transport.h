@@ -25,6 +25,7 @@ struct janus_transport_session {
 /* Transport callbacks */
 struct janus_transport_callbacks {
     void (*incoming_request)(janus_transport *plugin, janus_transport_session *transport, void *request_id, gboolean admin, json_t *message, json_error_t *error);
+    void (*transport_gone)(janus_transport *plugin, janus_transport_session *transport);
 };
 
 /* Transport plugin structure */
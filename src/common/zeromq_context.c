@@ -0,0 +1,164 @@
+/*! \file   zeromq_context.c
+ * \author Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief  Shared ZeroMQ context for the Janus ZeroMQ plugins
+ * \details  Implementation of the shared, refcounted ZeroMQ context, and
+ * of the CPU affinity helpers, used by both the ZeroMQ transport and the
+ * ZeroMQ event handler. See zeromq_context.h for more details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <zmq.h>
+
+#include "zeromq_context.h"
+#include "debug.h"
+#include "mutex.h"
+
+/* Maximum number of sockets in the shared context, for all plugins */
+#define JANUS_ZEROMQ_CONTEXT_MAX_SOCKETS	1024
+
+static janus_mutex context_mutex;
+static void *context = NULL;
+static int context_refs = 0;
+static int context_io_threads = 0;
+
+void *janus_zeromq_context_ref(const janus_zeromq_context_settings *settings, const char *owner) {
+	janus_mutex_lock(&context_mutex);
+	if(context != NULL) {
+		context_refs++;
+		int io_threads = (settings && settings->io_threads > 0) ? settings->io_threads : 1;
+		if(io_threads != context_io_threads) {
+			JANUS_LOG(LOG_WARN, "%s wants %d ZeroMQ I/O threads, but the shared context has %d already\n",
+				owner, io_threads, context_io_threads);
+		}
+		JANUS_LOG(LOG_VERB, "%s using the shared ZeroMQ context (%d users)\n", owner, context_refs);
+		janus_mutex_unlock(&context_mutex);
+		return context;
+	}
+	context = zmq_ctx_new();
+	if(context == NULL) {
+		JANUS_LOG(LOG_FATAL, "Could not initialize ZeroMQ context: %s\n", zmq_strerror(errno));
+		janus_mutex_unlock(&context_mutex);
+		return NULL;
+	}
+	/* All options must be set before the first socket is created, as
+	 * that's when the I/O threads are started */
+	context_io_threads = (settings && settings->io_threads > 0) ? settings->io_threads : 1;
+	zmq_ctx_set(context, ZMQ_IO_THREADS, context_io_threads);
+	zmq_ctx_set(context, ZMQ_MAX_SOCKETS, JANUS_ZEROMQ_CONTEXT_MAX_SOCKETS);
+	if(settings && settings->io_affinity) {
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+		GArray *cpus = g_array_new(FALSE, FALSE, sizeof(int));
+		if(!janus_zeromq_cpus_parse(settings->io_affinity, cpus)) {
+			JANUS_LOG(LOG_WARN, "Invalid CPU list '%s' for the ZeroMQ I/O threads, not pinning them\n", settings->io_affinity);
+		} else {
+			guint i = 0;
+			for(i = 0; i < cpus->len; i++)
+				zmq_ctx_set(context, ZMQ_THREAD_AFFINITY_CPU_ADD, g_array_index(cpus, int, i));
+		}
+		g_array_free(cpus, TRUE);
+#else
+		JANUS_LOG(LOG_WARN, "This version of ZeroMQ can't pin its I/O threads\n");
+#endif
+	}
+	if(settings && settings->io_sched_policy) {
+		int policy = -1;
+		if(!strcasecmp(settings->io_sched_policy, "other"))
+			policy = SCHED_OTHER;
+		else if(!strcasecmp(settings->io_sched_policy, "fifo"))
+			policy = SCHED_FIFO;
+		else if(!strcasecmp(settings->io_sched_policy, "rr"))
+			policy = SCHED_RR;
+		if(policy < 0) {
+			JANUS_LOG(LOG_WARN, "Unsupported scheduling policy '%s' for the ZeroMQ I/O threads\n", settings->io_sched_policy);
+		} else {
+			zmq_ctx_set(context, ZMQ_THREAD_SCHED_POLICY, policy);
+			if(policy != SCHED_OTHER)
+				zmq_ctx_set(context, ZMQ_THREAD_PRIORITY, settings->io_sched_priority);
+		}
+	}
+	context_refs = 1;
+	JANUS_LOG(LOG_INFO, "%s created the shared ZeroMQ context (%d I/O threads)\n", owner, context_io_threads);
+	janus_mutex_unlock(&context_mutex);
+	return context;
+}
+
+void janus_zeromq_context_unref(const char *owner) {
+	janus_mutex_lock(&context_mutex);
+	if(context == NULL || context_refs == 0) {
+		janus_mutex_unlock(&context_mutex);
+		return;
+	}
+	context_refs--;
+	if(context_refs > 0) {
+		JANUS_LOG(LOG_VERB, "%s released the shared ZeroMQ context (%d users left)\n", owner, context_refs);
+		janus_mutex_unlock(&context_mutex);
+		return;
+	}
+	zmq_ctx_destroy(context);
+	context = NULL;
+	context_io_threads = 0;
+	JANUS_LOG(LOG_INFO, "%s destroyed the shared ZeroMQ context\n", owner);
+	janus_mutex_unlock(&context_mutex);
+}
+
+gboolean janus_zeromq_cpus_parse(const char *value, GArray *cpus) {
+	if(value == NULL || cpus == NULL)
+		return FALSE;
+	gboolean ok = TRUE;
+	gchar **list = g_strsplit(value, ",", -1);
+	int i = 0;
+	for(i = 0; ok && list[i] != NULL; i++) {
+		gchar *entry = g_strstrip(list[i]);
+		if(*entry == '\0')
+			continue;
+		char *end = NULL;
+		long first = strtol(entry, &end, 10), last = first;
+		if(end == entry || first < 0) {
+			ok = FALSE;
+			break;
+		}
+		if(*end == '-') {
+			char *range = end + 1;
+			last = strtol(range, &end, 10);
+			if(end == range || last < first)
+				ok = FALSE;
+		}
+		if(*end != '\0' || last >= CPU_SETSIZE)
+			ok = FALSE;
+		long cpu = 0;
+		for(cpu = first; ok && cpu <= last; cpu++) {
+			int num = cpu;
+			g_array_append_val(cpus, num);
+		}
+	}
+	g_strfreev(list);
+	return ok && cpus->len > 0;
+}
+
+int janus_zeromq_thread_pin(const char *value) {
+	if(value == NULL)
+		return 0;
+	GArray *cpus = g_array_new(FALSE, FALSE, sizeof(int));
+	if(!janus_zeromq_cpus_parse(value, cpus)) {
+		JANUS_LOG(LOG_WARN, "Invalid CPU list '%s', not pinning thread\n", value);
+		g_array_free(cpus, TRUE);
+		return -1;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	guint i = 0;
+	for(i = 0; i < cpus->len; i++)
+		CPU_SET(g_array_index(cpus, int, i), &set);
+	g_array_free(cpus, TRUE);
+	int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(res != 0) {
+		JANUS_LOG(LOG_WARN, "Error pinning thread to CPUs %s: %s\n", value, g_strerror(res));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*! \file   zeromq_context.h
+ * \author Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief  Shared ZeroMQ context for the Janus ZeroMQ plugins (headers)
+ * \details  Helpers to share a single, refcounted ZeroMQ context between
+ * the ZeroMQ transport and event handler, rather than having each of them
+ * spawn its own I/O threads. The first plugin that needs the context
+ * creates it, with its settings (number of I/O threads, CPUs they're
+ * pinned to and their scheduling policy), and the last one to release
+ * it destroys it. Since Janus loads plugins with RTLD_GLOBAL, both end up
+ * using the same copy of these helpers, and so the same context. There
+ * also is a helper to pin the threads of the plugins to a set of CPUs,
+ * so that signalling can be kept away from the cores handling media.
+ */
+
+#ifndef JANUS_ZEROMQ_CONTEXT_H
+#define JANUS_ZEROMQ_CONTEXT_H
+
+#include <glib.h>
+
+/*! \brief Settings of the shared ZeroMQ context */
+typedef struct janus_zeromq_context_settings {
+	/*! \brief Number of ZeroMQ I/O threads (0 means the ZeroMQ default, 1) */
+	int io_threads;
+	/*! \brief CPUs the I/O threads should be pinned to (e.g., "2,3" or "2-3"), if any */
+	const char *io_affinity;
+	/*! \brief Scheduling policy of the I/O threads ("other", "fifo" or "rr"), if any */
+	const char *io_sched_policy;
+	/*! \brief Scheduling priority of the I/O threads, if a policy was set */
+	int io_sched_priority;
+} janus_zeromq_context_settings;
+
+/*! \brief Get a reference to the shared ZeroMQ context, creating it if needed
+ * @param[in] settings The settings to create the context with, if it doesn't exist yet
+ * @param[in] owner Name of the plugin asking for the context, for logging purposes
+ * @returns The ZeroMQ context, or NULL in case of errors */
+void *janus_zeromq_context_ref(const janus_zeromq_context_settings *settings, const char *owner);
+/*! \brief Release a reference to the shared ZeroMQ context, destroying it if it was the last one
+ * \note All the sockets created with the context must be closed before calling this
+ * @param[in] owner Name of the plugin releasing the context, for logging purposes */
+void janus_zeromq_context_unref(const char *owner);
+
+/*! \brief Parse a list of CPUs, e.g., "0,2" or "4-7"
+ * @param[in] value The list to parse
+ * @param[out] cpus Array the CPUs will be appended to (as ints)
+ * @returns TRUE if the list is valid, FALSE otherwise */
+gboolean janus_zeromq_cpus_parse(const char *value, GArray *cpus);
+/*! \brief Pin the calling thread to a list of CPUs
+ * @param[in] value The list of CPUs (see janus_zeromq_cpus_parse), or NULL to do nothing
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_zeromq_thread_pin(const char *value);
+
+#endif
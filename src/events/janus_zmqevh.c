@@ -13,12 +13,17 @@
  */
 
 #include <zmq.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "eventhandler.h"
 #include "debug.h"
 #include "config.h"
 #include "mutex.h"
 #include "utils.h"
+#include "zeromq_context.h"
 
 
 /* Plugin information */
@@ -73,8 +78,11 @@ janus_eventhandler *create(void) {
 /* Useful stuff */
 static gint initialized = 0, stopping = 0;
 
-/* ZeroMQ context and socket */
+/* ZeroMQ context (shared with the transport) and socket */
 static void *zmq_context = NULL;
+static janus_zeromq_context_settings context_settings = { 0 };
+/* CPUs the thread of the plugin should be pinned to, if any */
+static char *thread_affinity = NULL;
 static void *zmq_publisher = NULL;
 
 /* Configuration */
@@ -82,15 +90,143 @@ static char *address = NULL;
 static uint16_t port = 0;
 static gboolean enabled = FALSE;
 
-/* Event queue and thread */
-static GAsyncQueue *events = NULL;
+/* Event queues: bounded lock-free rings (Vyukov's bounded MPMC queue), so
+ * that the core and media threads handing us events never allocate nor
+ * take a lock. Each slot has a sequence number that tells producers and
+ * consumers whether it's free or full for their current lap of the ring */
+typedef struct janus_zmqevh_slot {
+	volatile gint sequence;		/* Position this slot can be written (== pos) or read (== pos+1) at */
+	json_t *event;				/* Queued event (a reference) */
+	gint64 queued;				/* When the event was queued */
+} janus_zmqevh_slot;
+/* Threads sleep on an eventfd when their ring is empty: producers only
+ * signal it when the thread says it's going to sleep */
+typedef struct janus_zmqevh_waker {
+	int fd;						/* eventfd the consumer sleeps on */
+	volatile gint sleeping;		/* Whether the consumer is (about to be) sleeping */
+} janus_zmqevh_waker;
+typedef struct janus_zmqevh_ring {
+	janus_zmqevh_slot *slots;
+	volatile gint head;			/* Next position to write */
+	volatile gint tail;			/* Next position to read */
+	janus_zmqevh_waker waker;	/* How to wake up the consumer */
+} janus_zmqevh_ring;
+static guint ring_size = 8192, ring_mask = 0;
+/* What to do with events when the ring is full (or they're too old) */
+typedef enum janus_zmqevh_drop_policy {
+	janus_zmqevh_drop_newest = 0,	/* Drop the events that don't fit */
+	janus_zmqevh_drop_oldest,		/* Make room by dropping the oldest queued event */
+	janus_zmqevh_drop_age			/* Drop the events that don't fit, and those queued for longer than max_age */
+} janus_zmqevh_drop_policy;
+static janus_zmqevh_drop_policy drop_policy = janus_zmqevh_drop_newest;
+static gint64 max_age = 2*G_USEC_PER_SEC;
+static volatile gint dropped_newest = 0, dropped_oldest = 0, dropped_expired = 0, dropped_outbox = 0;
 static GThread *event_thread = NULL;
 static void *janus_zmqevh_thread(void *data);
 
-/* Event structure for queueing */
-typedef struct janus_zmqevh_event {
-	json_t *event;
-} janus_zmqevh_event;
+/* Batching: rather than publishing events one by one, we can gather up to
+ * batch_size of them in a single JSON array, or in a single multipart
+ * message (one event per frame). How long we wait for a batch to fill up
+ * adapts to the load: when idle, events are flushed as soon as the ring
+ * is empty, while when batches fill up the wait grows (up to
+ * batch_window), and it shrinks back when they don't */
+static gboolean batching = FALSE;
+static gboolean batch_multipart = FALSE;
+static guint batch_size = 100;
+static gint64 batch_window = 10000;		/* In microseconds */
+#define JANUS_ZMQEVH_BATCH_MIN_WAIT		1000
+static volatile gint events_published = 0, batches_published = 0;
+/* Batches being filled: a single one, or one per event type when
+ * publishing with topics, as events in a batch share the topic */
+typedef struct janus_zmqevh_batch {
+	GString *buffer;	/* JSON array */
+	GPtrArray *frames;	/* Serialized events, when multipart */
+	guint count;		/* Number of events in the batch */
+	gint64 deadline;	/* When the batch must be published, at the latest */
+} janus_zmqevh_batch;
+static guint batches_num = 0;
+
+/* Serializers: each has its own ring, and turns the events queued there
+ * into publications (batching them, if needed). With no workers, the event
+ * thread is the only serializer, and publishes what it serializes right
+ * away. With workers, events are sharded among them by session (or handle)
+ * ID, so that the events of a session are still published in order, and
+ * the publications are passed to the event thread, the only one that can
+ * use the socket, via a lock-free outbox */
+typedef struct janus_zmqevh_serializer {
+	guint index;					/* Index of the serializer (and worker) */
+	janus_zmqevh_ring ring;			/* Events to serialize */
+	janus_zmqevh_batch *batches;	/* Batches being filled, if batching */
+	gint64 batch_wait;				/* Current batching wait, in microseconds */
+	GPtrArray *subscriptions;		/* Snapshot of the subscriptions, when using XPUB */
+	gint subscriptions_version;		/* Version of that snapshot */
+	GThread *thread;				/* Worker thread, if any */
+} janus_zmqevh_serializer;
+static janus_zmqevh_serializer *serializers = NULL;
+static guint serializers_num = 0, workers_num = 0;
+static void *janus_zmqevh_worker(void *data);
+/* Serialized event (or batch of events), with its topic */
+typedef struct janus_zmqevh_publication {
+	struct janus_zmqevh_publication *next;	/* Next publication in the outbox */
+	char topic[128];						/* Topic, if needed */
+	int topic_len;							/* Length of the topic */
+	GString *payload;						/* Serialized event, or JSON array of events */
+	GPtrArray *frames;						/* Serialized events, when multipart */
+	guint count;							/* Number of events */
+} janus_zmqevh_publication;
+/* Lock-free multiple producers/single consumer outbox, as the transport's
+ * mailbox: workers push to the head with a CAS, and the event thread takes
+ * the whole list at once, waking up on the empty->non-empty transition */
+static janus_zmqevh_publication *outbox = NULL;
+static int outbox_fd = -1;
+static volatile gint outbox_pending = 0;
+
+/* Topics: events can be published with a topic frame preceding them, so that
+ * subscribers can filter them by prefix (which ZeroMQ does on the publisher
+ * side). Topics are "<type>/", followed by "<package>/" for events that come
+ * from a plugin or transport, and by "<session>/" for events related to a
+ * session (if topic_session is true), e.g., "media/1234/" or
+ * "plugin/janus.plugin.videoroom/1234/". Batches only have the type as topic */
+static gboolean topics = FALSE;
+static gboolean topic_session = TRUE;
+/* Topic names of the event types: the last one is for events of any other type */
+static const struct {
+	guint32 type;
+	const char *name;
+} event_types[] = {
+	{ JANUS_EVENT_TYPE_SESSION, "session" },
+	{ JANUS_EVENT_TYPE_HANDLE, "handle" },
+#ifdef JANUS_EVENT_TYPE_EXTERNAL
+	{ JANUS_EVENT_TYPE_EXTERNAL, "external" },
+#endif
+	{ JANUS_EVENT_TYPE_JSEP, "jsep" },
+	{ JANUS_EVENT_TYPE_WEBRTC, "webrtc" },
+	{ JANUS_EVENT_TYPE_MEDIA, "media" },
+	{ JANUS_EVENT_TYPE_PLUGIN, "plugin" },
+	{ JANUS_EVENT_TYPE_TRANSPORT, "transport" },
+	{ JANUS_EVENT_TYPE_CORE, "core" },
+	{ JANUS_EVENT_TYPE_NONE, "other" }
+};
+#define JANUS_ZMQEVH_EVENT_TYPES	(sizeof(event_types)/sizeof(*event_types))
+
+/* XPUB: when enabled, the publisher socket tells us what subscribers are
+ * subscribed to, so that we don't serialize events nobody would receive:
+ * ZeroMQ only passes the first subscription to a prefix and the last
+ * unsubscription, so a set of prefixes is all we need. With topics, this
+ * also narrows the events mask the core checks to the event types someone
+ * is subscribed to, which spares it from even queueing the other events */
+static gboolean xpub = FALSE;
+static GHashTable *subscriptions = NULL;	/* Written by the event thread only */
+static janus_mutex subscriptions_mutex;
+/* What serializers check: an immutable list of the prefixes, replaced (and
+ * the version bumped) when subscriptions change, so that they only need
+ * the mutex to get a reference to the new one when that happens */
+static GPtrArray *subscriptions_snapshot = NULL;
+static volatile gint subscriptions_version = 0;
+static guint32 events_mask = JANUS_EVENT_TYPE_NONE;	/* Mask from the configuration */
+static volatile gint events_unsubscribed = 0;
+/* How many events we handle before checking for new subscriptions, when busy */
+#define JANUS_ZMQEVH_SUBSCRIPTIONS_CHECK	64
 
 
 /* Plugin implementation */
@@ -122,6 +258,490 @@ const char *janus_zmqevh_get_package(void) {
 	return JANUS_ZMQEVH_PACKAGE;
 }
 
+/* Event ring management */
+static const char *janus_zmqevh_drop_policy_str(janus_zmqevh_drop_policy policy) {
+	switch(policy) {
+		case janus_zmqevh_drop_newest:
+			return "newest";
+		case janus_zmqevh_drop_oldest:
+			return "oldest";
+		case janus_zmqevh_drop_age:
+			return "age";
+		default:
+			break;
+	}
+	return NULL;
+}
+
+static int janus_zmqevh_ring_init(janus_zmqevh_ring *ring) {
+	ring->slots = g_malloc0(ring_size * sizeof(janus_zmqevh_slot));
+	guint i = 0;
+	for(i = 0; i < ring_size; i++)
+		ring->slots[i].sequence = (gint)i;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->waker.sleeping = 0;
+	ring->waker.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(ring->waker.fd < 0) {
+		JANUS_LOG(LOG_FATAL, "Could not create event handler eventfd: %s\n", g_strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static gboolean janus_zmqevh_ring_push(janus_zmqevh_ring *ring, json_t *event, gint64 now) {
+	guint pos = (guint)g_atomic_int_get(&ring->head);
+	janus_zmqevh_slot *slot = NULL;
+	while(TRUE) {
+		slot = &ring->slots[pos & ring_mask];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - pos);
+		if(diff == 0) {
+			/* The slot is free, try to claim it */
+			if(g_atomic_int_compare_and_exchange(&ring->head, (gint)pos, (gint)(pos + 1)))
+				break;
+		} else if(diff < 0) {
+			/* The ring is full */
+			return FALSE;
+		}
+		/* Someone else got there first */
+		pos = (guint)g_atomic_int_get(&ring->head);
+	}
+	slot->event = event;
+	slot->queued = now;
+	g_atomic_int_set(&slot->sequence, (gint)(pos + 1));
+	return TRUE;
+}
+
+static json_t *janus_zmqevh_ring_pop(janus_zmqevh_ring *ring, gint64 *queued) {
+	guint pos = (guint)g_atomic_int_get(&ring->tail);
+	janus_zmqevh_slot *slot = NULL;
+	while(TRUE) {
+		slot = &ring->slots[pos & ring_mask];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - (pos + 1));
+		if(diff == 0) {
+			/* The slot is full, try to claim it */
+			if(g_atomic_int_compare_and_exchange(&ring->tail, (gint)pos, (gint)(pos + 1)))
+				break;
+		} else if(diff < 0) {
+			/* The ring is empty */
+			return NULL;
+		}
+		pos = (guint)g_atomic_int_get(&ring->tail);
+	}
+	json_t *event = slot->event;
+	if(queued)
+		*queued = slot->queued;
+	slot->event = NULL;
+	/* Make the slot available to producers in their next lap */
+	g_atomic_int_set(&slot->sequence, (gint)(pos + ring_mask + 1));
+	return event;
+}
+
+static gboolean janus_zmqevh_ring_is_empty(janus_zmqevh_ring *ring) {
+	guint pos = (guint)g_atomic_int_get(&ring->tail);
+	return (guint)g_atomic_int_get(&ring->slots[pos & ring_mask].sequence) != pos + 1;
+}
+
+static guint janus_zmqevh_ring_size(janus_zmqevh_ring *ring) {
+	return (guint)(g_atomic_int_get(&ring->head) - g_atomic_int_get(&ring->tail));
+}
+
+static void janus_zmqevh_ring_destroy(janus_zmqevh_ring *ring) {
+	if(ring->slots != NULL) {
+		json_t *event = NULL;
+		while((event = janus_zmqevh_ring_pop(ring, NULL)) != NULL)
+			json_decref(event);
+		g_free(ring->slots);
+		ring->slots = NULL;
+	}
+	if(ring->waker.fd != -1) {
+		close(ring->waker.fd);
+		ring->waker.fd = -1;
+	}
+}
+
+/* Wakes up a thread, either unconditionally or only if it's sleeping */
+static void janus_zmqevh_signal(int fd) {
+	uint64_t one = 1;
+	if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_WARN, "Error waking up a ZeroMQ event handler thread: %s\n", g_strerror(errno));
+}
+
+static void janus_zmqevh_wakeup(janus_zmqevh_waker *waker) {
+	if(!g_atomic_int_get(&waker->sleeping) || !g_atomic_int_compare_and_exchange(&waker->sleeping, 1, 0))
+		return;
+	janus_zmqevh_signal(waker->fd);
+}
+
+static void janus_zmqevh_drain(int fd) {
+	uint64_t count = 0;
+	if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_WARN, "Error reading event handler eventfd: %s\n", g_strerror(errno));
+}
+
+/* Publishing */
+static int janus_zmqevh_dump_cb(const char *data, size_t size, void *user_data) {
+	g_string_append_len((GString *)user_data, data, size);
+	return 0;
+}
+
+/* Sends a frame on the PUB socket: this never blocks, as when a subscriber
+ * can't keep up and reaches the high water mark, ZeroMQ silently drops
+ * what's meant for it (and doesn't tell us, so we can't count those) */
+static int janus_zmqevh_send(const char *payload, size_t len, int flags, guint events) {
+	int ret = zmq_send(zmq_publisher, payload, len, flags | ZMQ_DONTWAIT);
+	if(ret < 0)
+		JANUS_LOG(LOG_ERR, "Error publishing ZeroMQ event%s: %s\n", events > 1 ? "s" : "", zmq_strerror(errno));
+	return ret;
+}
+
+/* Returns the index of the type of an event in event_types */
+static guint janus_zmqevh_event_type(json_t *event) {
+	json_int_t type = json_integer_value(json_object_get(event, "type"));
+	guint i = 0;
+	for(i = 0; i < JANUS_ZMQEVH_EVENT_TYPES - 1; i++) {
+		if(type == event_types[i].type)
+			return i;
+	}
+	return JANUS_ZMQEVH_EVENT_TYPES - 1;
+}
+
+/* Builds the topic of an event, returning its length */
+static int janus_zmqevh_topic(json_t *event, guint type, char *topic, size_t size) {
+	int len = g_snprintf(topic, size, "%s/", event_types[type].name);
+	json_t *body = json_object_get(event, "event");
+	json_t *package = json_object_get(body, "plugin");
+	if(!json_is_string(package))
+		package = json_object_get(body, "transport");
+	if(json_is_string(package) && (size_t)len < size)
+		len += g_snprintf(topic + len, size - len, "%s/", json_string_value(package));
+	json_t *session_id = json_object_get(event, "session_id");
+	if(topic_session && json_is_integer(session_id) && (size_t)len < size)
+		len += g_snprintf(topic + len, size - len, "%"SCNu64"/", (guint64)json_integer_value(session_id));
+	return MIN((size_t)len, size - 1);
+}
+
+/* Subscriptions management */
+static GPtrArray *janus_zmqevh_subscriptions_get(janus_zmqevh_serializer *serializer) {
+	if(serializer->subscriptions != NULL && g_atomic_int_get(&subscriptions_version) == serializer->subscriptions_version)
+		return serializer->subscriptions;
+	/* Subscriptions changed, get a reference to the new snapshot */
+	GPtrArray *old = serializer->subscriptions;
+	janus_mutex_lock(&subscriptions_mutex);
+	serializer->subscriptions = g_ptr_array_ref(subscriptions_snapshot);
+	serializer->subscriptions_version = g_atomic_int_get(&subscriptions_version);
+	janus_mutex_unlock(&subscriptions_mutex);
+	if(old != NULL)
+		g_ptr_array_unref(old);
+	return serializer->subscriptions;
+}
+
+static gboolean janus_zmqevh_subscribed(GPtrArray *prefixes, const char *topic, size_t len) {
+	if(!topics)
+		return prefixes->len > 0;
+	guint i = 0;
+	for(i = 0; i < prefixes->len; i++) {
+		const char *prefix = g_ptr_array_index(prefixes, i);
+		size_t prefix_len = strlen(prefix);
+		if(prefix_len <= len && !strncmp(prefix, topic, prefix_len))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Computes the events mask that matches the current subscriptions */
+static void janus_zmqevh_subscriptions_mask(void) {
+	guint32 mask = JANUS_EVENT_TYPE_NONE;
+	if(!topics) {
+		if(g_hash_table_size(subscriptions) > 0)
+			mask = events_mask;
+	} else {
+		/* A type is needed if a subscription is a prefix of its topics, or starts with them */
+		guint i = 0;
+		for(i = 0; i < JANUS_ZMQEVH_EVENT_TYPES - 1; i++) {
+			char type[32];
+			size_t type_len = g_snprintf(type, sizeof(type), "%s/", event_types[i].name);
+			GHashTableIter iter;
+			gpointer key = NULL;
+			g_hash_table_iter_init(&iter, subscriptions);
+			while(g_hash_table_iter_next(&iter, &key, NULL)) {
+				size_t prefix_len = strlen((const char *)key);
+				if(!strncmp((const char *)key, type, MIN(prefix_len, type_len))) {
+					mask |= event_types[i].type;
+					break;
+				}
+			}
+		}
+		mask &= events_mask;
+	}
+	if(janus_zmqevh.events_mask != mask)
+		JANUS_LOG(LOG_VERB, "Subscriptions changed, events mask is now %"SCNu32"\n", mask);
+	janus_zmqevh.events_mask = mask;
+}
+
+/* Replaces the snapshot of the subscriptions serializers check (called with the mutex locked) */
+static void janus_zmqevh_subscriptions_snapshot(void) {
+	GPtrArray *snapshot = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
+	GHashTableIter iter;
+	gpointer key = NULL;
+	g_hash_table_iter_init(&iter, subscriptions);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(snapshot, g_strdup((const char *)key));
+	if(subscriptions_snapshot != NULL)
+		g_ptr_array_unref(subscriptions_snapshot);
+	subscriptions_snapshot = snapshot;
+	g_atomic_int_inc(&subscriptions_version);
+}
+
+/* Reads the subscriptions and unsubscriptions the XPUB socket has for us */
+static void janus_zmqevh_subscriptions_read(void) {
+	gboolean changed = FALSE;
+	janus_mutex_lock(&subscriptions_mutex);
+	while(TRUE) {
+		zmq_msg_t message;
+		zmq_msg_init(&message);
+		if(zmq_msg_recv(&message, zmq_publisher, ZMQ_DONTWAIT) < 0) {
+			zmq_msg_close(&message);
+			break;
+		}
+		const char *data = zmq_msg_data(&message);
+		size_t len = zmq_msg_size(&message);
+		/* The first byte is 1 for subscriptions and 0 for unsubscriptions */
+		if(len > 0 && (data[0] == 1 || data[0] == 0)) {
+			char *prefix = g_strndup(data + 1, len - 1);
+			JANUS_LOG(LOG_VERB, "%s '%s'\n", data[0] ? "New subscription to" : "No more subscriptions to", prefix);
+			if(data[0] == 1 && topics && batching && strchr(prefix, '/') != NULL && strchr(prefix, '/')[1] != '\0') {
+				JANUS_LOG(LOG_WARN, "Subscription to '%s' is narrower than an event type, it won't match any batch\n", prefix);
+			}
+			if(data[0] == 1) {
+				g_hash_table_add(subscriptions, prefix);
+			} else {
+				g_hash_table_remove(subscriptions, prefix);
+				g_free(prefix);
+			}
+			changed = TRUE;
+		}
+		zmq_msg_close(&message);
+	}
+	if(changed)
+		janus_zmqevh_subscriptions_snapshot();
+	janus_mutex_unlock(&subscriptions_mutex);
+	if(changed)
+		janus_zmqevh_subscriptions_mask();
+}
+
+/* Publishes a serialized event or batch: only called by the event thread */
+static void janus_zmqevh_publish(const char *topic, int topic_len, GString *payload, GPtrArray *frames, guint count) {
+	int ret = 0;
+	if(topics)
+		ret = janus_zmqevh_send(topic, topic_len, ZMQ_SNDMORE, count);
+	if(frames != NULL) {
+		guint i = 0;
+		for(i = 0; i < frames->len && ret >= 0; i++) {
+			char *frame = g_ptr_array_index(frames, i);
+			/* Only the first frame can fail: then the whole message goes through */
+			ret = janus_zmqevh_send(frame, strlen(frame), (i < frames->len - 1) ? ZMQ_SNDMORE : 0, count);
+		}
+	} else if(ret >= 0) {
+		JANUS_LOG(LOG_HUGE, "Publishing ZeroMQ event%s: %s\n", count > 1 ? "s" : "", payload->str);
+		ret = janus_zmqevh_send(payload->str, payload->len, 0, count);
+	}
+	if(ret >= 0) {
+		g_atomic_int_add(&events_published, count);
+		if(batching)
+			g_atomic_int_inc(&batches_published);
+	}
+}
+
+static void janus_zmqevh_publication_free(janus_zmqevh_publication *publication) {
+	if(publication->payload != NULL)
+		g_string_free(publication->payload, TRUE);
+	if(publication->frames != NULL)
+		g_ptr_array_free(publication->frames, TRUE);
+	g_free(publication);
+}
+
+/* Publishes all the publications workers queued: only called by the event
+ * thread (or when it's gone), and returns how many there were */
+static guint janus_zmqevh_outbox_flush(void) {
+	janus_zmqevh_drain(outbox_fd);
+	janus_zmqevh_publication *list = NULL;
+	do {
+		list = g_atomic_pointer_get(&outbox);
+	} while(list != NULL && !g_atomic_pointer_compare_and_exchange(&outbox, list, NULL));
+	/* Reverse the list, as workers push to the head */
+	janus_zmqevh_publication *ordered = NULL;
+	while(list != NULL) {
+		janus_zmqevh_publication *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	guint count = 0;
+	while(ordered != NULL) {
+		janus_zmqevh_publication *next = ordered->next;
+		janus_zmqevh_publish(ordered->topic, ordered->topic_len, ordered->payload, ordered->frames, ordered->count);
+		janus_zmqevh_publication_free(ordered);
+		ordered = next;
+		count++;
+	}
+	if(count > 0)
+		g_atomic_int_add(&outbox_pending, -(gint)count);
+	return count;
+}
+
+/* Hands a serialized event or batch over to be published, taking ownership
+ * of the payload or frames: if we're the event thread, we publish it right
+ * away, while workers queue it in the outbox for the event thread */
+static void janus_zmqevh_emit(const char *topic, int topic_len, GString *payload, GPtrArray *frames, guint count) {
+	if(workers_num == 0) {
+		janus_zmqevh_publish(topic, topic_len, payload, frames, count);
+		if(payload != NULL)
+			g_string_free(payload, TRUE);
+		if(frames != NULL)
+			g_ptr_array_free(frames, TRUE);
+		return;
+	}
+	if(g_atomic_int_get(&outbox_pending) >= (gint)ring_size) {
+		/* The event thread can't keep up with the workers */
+		g_atomic_int_add(&dropped_outbox, count);
+		JANUS_LOG(LOG_WARN, "ZeroMQ event handler outbox full, %u event(s) dropped\n", count);
+		if(payload != NULL)
+			g_string_free(payload, TRUE);
+		if(frames != NULL)
+			g_ptr_array_free(frames, TRUE);
+		return;
+	}
+	janus_zmqevh_publication *publication = g_malloc(sizeof(janus_zmqevh_publication));
+	publication->topic_len = MIN(topic_len, (int)sizeof(publication->topic));
+	memcpy(publication->topic, topic, publication->topic_len);
+	publication->payload = payload;
+	publication->frames = frames;
+	publication->count = count;
+	g_atomic_int_inc(&outbox_pending);
+	janus_zmqevh_publication *head = NULL;
+	do {
+		head = g_atomic_pointer_get(&outbox);
+		publication->next = head;
+	} while(!g_atomic_pointer_compare_and_exchange(&outbox, head, publication));
+	if(head == NULL) {
+		/* The outbox was empty, the event thread may be sleeping: wake it up */
+		janus_zmqevh_signal(outbox_fd);
+	}
+}
+
+/* Hands a batch over to be published, if it's not empty, and adapts the batching window to how full it was */
+static void janus_zmqevh_batch_flush(janus_zmqevh_serializer *serializer, janus_zmqevh_batch *batch, guint type) {
+	if(batch->count == 0)
+		return;
+	char topic[32];
+	int topic_len = topics ? g_snprintf(topic, sizeof(topic), "%s/", event_types[type].name) : 0;
+	if(batch_multipart) {
+		janus_zmqevh_emit(topic, topic_len, NULL, batch->frames, batch->count);
+		batch->frames = g_ptr_array_new_with_free_func(free);
+	} else {
+		g_string_append_c(batch->buffer, ']');
+		janus_zmqevh_emit(topic, topic_len, batch->buffer, NULL, batch->count);
+		batch->buffer = g_string_sized_new(4096);
+	}
+	/* Full batches mean we're under pressure, and should wait longer for the next ones */
+	if(batch->count >= batch_size) {
+		serializer->batch_wait = MIN(MAX(serializer->batch_wait * 2, JANUS_ZMQEVH_BATCH_MIN_WAIT), batch_window);
+	} else if(batch->count <= batch_size / 4) {
+		serializer->batch_wait /= 2;
+		if(serializer->batch_wait < JANUS_ZMQEVH_BATCH_MIN_WAIT)
+			serializer->batch_wait = 0;
+	}
+	batch->count = 0;
+}
+
+/* Adds an event to the batch for its type, handing it over if it's full */
+static void janus_zmqevh_batch_add(janus_zmqevh_serializer *serializer, json_t *event, guint type) {
+	janus_zmqevh_batch *batch = &serializer->batches[topics ? type : 0];
+	if(batch_multipart) {
+		char *payload = json_dumps(event, JSON_COMPACT);
+		if(payload == NULL) {
+			JANUS_LOG(LOG_ERR, "Failed to serialize JSON event\n");
+			return;
+		}
+		g_ptr_array_add(batch->frames, payload);
+	} else {
+		size_t len = batch->buffer->len;
+		g_string_append_c(batch->buffer, batch->count == 0 ? '[' : ',');
+		if(json_dump_callback(event, janus_zmqevh_dump_cb, batch->buffer, JSON_COMPACT) < 0) {
+			JANUS_LOG(LOG_ERR, "Failed to serialize JSON event\n");
+			g_string_truncate(batch->buffer, len);
+			return;
+		}
+	}
+	if(batch->count == 0)
+		batch->deadline = g_get_monotonic_time() + serializer->batch_wait;
+	batch->count++;
+	if(batch->count >= batch_size)
+		janus_zmqevh_batch_flush(serializer, batch, topics ? type : 0);
+}
+
+/* Hands over the batches that are due (all of them, if force is TRUE),
+ * returning how long (in milliseconds) until the next one is, or -1 */
+static int janus_zmqevh_batches_check(janus_zmqevh_serializer *serializer, gboolean force) {
+	if(serializer->batches == NULL)
+		return -1;
+	gint64 now = g_get_monotonic_time(), next = -1;
+	guint i = 0;
+	for(i = 0; i < batches_num; i++) {
+		janus_zmqevh_batch *batch = &serializer->batches[i];
+		if(batch->count == 0)
+			continue;
+		if(force || serializer->batch_wait == 0 || now >= batch->deadline)
+			janus_zmqevh_batch_flush(serializer, batch, i);
+		else if(next == -1 || batch->deadline < next)
+			next = batch->deadline;
+	}
+	return next == -1 ? -1 : (int)((next - now + 999) / 1000);
+}
+
+/* Serializes an event taken from the ring of a serializer (or drops it), and releases it */
+static void janus_zmqevh_serialize(janus_zmqevh_serializer *serializer, json_t *event, gint64 queued) {
+	if(drop_policy == janus_zmqevh_drop_age && g_get_monotonic_time() - queued > max_age) {
+		/* We're lagging behind, and this event is too old to be worth sending */
+		g_atomic_int_inc(&dropped_expired);
+		json_decref(event);
+		return;
+	}
+	
+	/* Batches only have the type as topic */
+	guint type = janus_zmqevh_event_type(event);
+	char topic[128];
+	int topic_len = 0;
+	if(topics) {
+		topic_len = batching ? g_snprintf(topic, sizeof(topic), "%s/", event_types[type].name) :
+			janus_zmqevh_topic(event, type, topic, sizeof(topic));
+	}
+	if(xpub && !janus_zmqevh_subscribed(janus_zmqevh_subscriptions_get(serializer), topic, topic_len)) {
+		/* Nobody would get this event, don't bother serializing it */
+		g_atomic_int_inc(&events_unsubscribed);
+		json_decref(event);
+		return;
+	}
+	
+	if(batching) {
+		janus_zmqevh_batch_add(serializer, event, type);
+		json_decref(event);
+		return;
+	}
+	
+	/* Serialize event */
+	GString *payload = g_string_sized_new(512);
+	if(json_dump_callback(event, janus_zmqevh_dump_cb, payload, JSON_COMPACT) < 0) {
+		JANUS_LOG(LOG_ERR, "Failed to serialize JSON event\n");
+		g_string_free(payload, TRUE);
+		json_decref(event);
+		return;
+	}
+	json_decref(event);
+	janus_zmqevh_emit(topic, topic_len, payload, NULL, 1);
+}
+
 /* Initialization */
 int janus_zmqevh_init(const char *config_path) {
 	if(g_atomic_int_get(&stopping)) {
@@ -129,17 +749,6 @@ int janus_zmqevh_init(const char *config_path) {
 		return -1;
 	}
 	
-	/* Initialize ZeroMQ context */
-	zmq_context = zmq_ctx_new();
-	if(zmq_context == NULL) {
-		JANUS_LOG(LOG_FATAL, "Could not initialize ZeroMQ context: %s\n", zmq_strerror(errno));
-		return -1;
-	}
-
-	/* Set context options */
-	zmq_ctx_set(zmq_context, ZMQ_IO_THREADS, 2);
-	zmq_ctx_set(zmq_context, ZMQ_MAX_SOCKETS, 256);
-
 	/* Read configuration */
 	char filename[255];
 	g_snprintf(filename, 255, "%s/%s.jcfg", config_path, JANUS_ZMQEVH_PACKAGE);
@@ -196,6 +805,10 @@ int janus_zmqevh_init(const char *config_path) {
 									janus_zmqevh.events_mask |= JANUS_EVENT_TYPE_SESSION;
 								} else if(!strcasecmp(index, "handles")) {
 									janus_zmqevh.events_mask |= JANUS_EVENT_TYPE_HANDLE;
+#ifdef JANUS_EVENT_TYPE_EXTERNAL
+								} else if(!strcasecmp(index, "external")) {
+									janus_zmqevh.events_mask |= JANUS_EVENT_TYPE_EXTERNAL;
+#endif
 								} else if(!strcasecmp(index, "jsep")) {
 									janus_zmqevh.events_mask |= JANUS_EVENT_TYPE_JSEP;
 								} else if(!strcasecmp(index, "webrtc")) {
@@ -222,6 +835,112 @@ int janus_zmqevh_init(const char *config_path) {
 				/* Default to all events */
 				janus_zmqevh.events_mask = JANUS_EVENT_TYPE_ALL;
 			}
+			
+			/* ZeroMQ I/O threads (if we're the first to need them), and where our own thread should run */
+			item = janus_config_get(config, config_general, janus_config_type_item, "io_threads");
+			if(item && item->value)
+				context_settings.io_threads = MAX(0, atoi(item->value));
+			item = janus_config_get(config, config_general, janus_config_type_item, "io_affinity");
+			if(item && item->value)
+				context_settings.io_affinity = g_strdup(item->value);
+			item = janus_config_get(config, config_general, janus_config_type_item, "io_sched_policy");
+			if(item && item->value)
+				context_settings.io_sched_policy = g_strdup(item->value);
+			item = janus_config_get(config, config_general, janus_config_type_item, "io_sched_priority");
+			if(item && item->value)
+				context_settings.io_sched_priority = atoi(item->value);
+			item = janus_config_get(config, config_general, janus_config_type_item, "thread_affinity");
+			if(item && item->value)
+				thread_affinity = g_strdup(item->value);
+			
+			/* How many events we can queue, and what to drop when we can't keep up */
+			item = janus_config_get(config, config_general, janus_config_type_item, "queue_size");
+			if(item && item->value) {
+				int size = atoi(item->value);
+				if(size < 2 || size > (1 << 24)) {
+					JANUS_LOG(LOG_WARN, "Invalid queue size (%d), using default (%u)\n", size, ring_size);
+				} else {
+					/* The ring needs a power of two */
+					ring_size = 2;
+					while(ring_size < (guint)size)
+						ring_size <<= 1;
+				}
+			}
+			item = janus_config_get(config, config_general, janus_config_type_item, "drop_policy");
+			if(item && item->value) {
+				if(!strcasecmp(item->value, "newest")) {
+					drop_policy = janus_zmqevh_drop_newest;
+				} else if(!strcasecmp(item->value, "oldest")) {
+					drop_policy = janus_zmqevh_drop_oldest;
+				} else if(!strcasecmp(item->value, "age")) {
+					drop_policy = janus_zmqevh_drop_age;
+				} else {
+					JANUS_LOG(LOG_WARN, "Unknown drop policy '%s', using 'newest'\n", item->value);
+				}
+			}
+			/* Whether events should be published in batches */
+			item = janus_config_get(config, config_general, janus_config_type_item, "batching");
+			if(item && item->value)
+				batching = janus_is_true(item->value);
+			item = janus_config_get(config, config_general, janus_config_type_item, "batch_format");
+			if(item && item->value) {
+				if(!strcasecmp(item->value, "multipart")) {
+					batch_multipart = TRUE;
+				} else if(strcasecmp(item->value, "array")) {
+					JANUS_LOG(LOG_WARN, "Unknown batch format '%s', using 'array'\n", item->value);
+				}
+			}
+			item = janus_config_get(config, config_general, janus_config_type_item, "batch_size");
+			if(item && item->value) {
+				int size = atoi(item->value);
+				if(size < 1) {
+					JANUS_LOG(LOG_WARN, "Invalid batch size (%d), using default (%u)\n", size, batch_size);
+				} else {
+					batch_size = size;
+				}
+			}
+			item = janus_config_get(config, config_general, janus_config_type_item, "batch_window");
+			if(item && item->value) {
+				int window = atoi(item->value);
+				if(window < 0) {
+					JANUS_LOG(LOG_WARN, "Invalid batch window (%d), using default (%"SCNi64"ms)\n", window, batch_window/1000);
+				} else {
+					batch_window = (gint64)window * 1000;
+				}
+			}
+			
+			/* Whether events should be published with a topic */
+			item = janus_config_get(config, config_general, janus_config_type_item, "topics");
+			if(item && item->value)
+				topics = janus_is_true(item->value);
+			item = janus_config_get(config, config_general, janus_config_type_item, "topic_session");
+			if(item && item->value)
+				topic_session = janus_is_true(item->value);
+			/* Whether we should only serialize the events someone is subscribed to */
+			item = janus_config_get(config, config_general, janus_config_type_item, "xpub");
+			if(item && item->value)
+				xpub = janus_is_true(item->value);
+			
+			/* How many threads should serialize events */
+			item = janus_config_get(config, config_general, janus_config_type_item, "workers");
+			if(item && item->value) {
+				int workers = atoi(item->value);
+				if(workers < 0 || workers > 128) {
+					JANUS_LOG(LOG_WARN, "Invalid number of workers (%d), serializing events in the event thread\n", workers);
+				} else {
+					workers_num = workers;
+				}
+			}
+			
+			item = janus_config_get(config, config_general, janus_config_type_item, "max_age");
+			if(item && item->value) {
+				int age = atoi(item->value);
+				if(age < 1) {
+					JANUS_LOG(LOG_WARN, "Invalid max age (%d), using default (%"SCNi64"ms)\n", age, max_age/1000);
+				} else {
+					max_age = (gint64)age * 1000;
+				}
+			}
 		}
 		
 		janus_config_destroy(config);
@@ -232,14 +951,47 @@ int janus_zmqevh_init(const char *config_path) {
 		return 0;
 	}
 
-	/* Create event queue */
-	events = g_async_queue_new();
+	/* Get a reference to the ZeroMQ context we share with the transport */
+	zmq_context = janus_zeromq_context_ref(&context_settings, JANUS_ZMQEVH_NAME);
+	if(zmq_context == NULL)
+		return -1;
+
+	/* Create the serializers, each with its event ring, and the eventfd its consumer sleeps on */
+	ring_mask = ring_size - 1;
+	serializers_num = MAX(workers_num, 1);
+	batches_num = batching ? (topics ? JANUS_ZMQEVH_EVENT_TYPES : 1) : 0;
+	serializers = g_malloc0(serializers_num * sizeof(janus_zmqevh_serializer));
+	guint i = 0, j = 0;
+	for(i = 0; i < serializers_num; i++) {
+		janus_zmqevh_serializer *serializer = &serializers[i];
+		serializer->index = i;
+		if(janus_zmqevh_ring_init(&serializer->ring) < 0)
+			return -1;
+		if(batches_num > 0) {
+			serializer->batches = g_malloc0(batches_num * sizeof(janus_zmqevh_batch));
+			for(j = 0; j < batches_num; j++) {
+				if(batch_multipart)
+					serializer->batches[j].frames = g_ptr_array_new_with_free_func(free);
+				else
+					serializer->batches[j].buffer = g_string_sized_new(4096);
+			}
+		}
+	}
+	if(workers_num > 0) {
+		outbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(outbox_fd < 0) {
+			JANUS_LOG(LOG_FATAL, "Could not create event handler eventfd: %s\n", g_strerror(errno));
+			return -1;
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Queueing up to %u events%s, dropping the %s ones\n", ring_size, workers_num > 0 ? " per worker" : "",
+		drop_policy == janus_zmqevh_drop_oldest ? "oldest" : (drop_policy == janus_zmqevh_drop_age ? "newest or expired" : "newest"));
 
 	/* Setup publisher socket */
 	char bind_address[256];
 	g_snprintf(bind_address, sizeof(bind_address), "%s:%d", address, port);
 	
-	zmq_publisher = zmq_socket(zmq_context, ZMQ_PUB);
+	zmq_publisher = zmq_socket(zmq_context, xpub ? ZMQ_XPUB : ZMQ_PUB);
 	if(zmq_publisher == NULL) {
 		JANUS_LOG(LOG_FATAL, "Could not create ZeroMQ publisher socket: %s\n", zmq_strerror(errno));
 		return -1;
@@ -249,7 +1001,8 @@ int janus_zmqevh_init(const char *config_path) {
 	int linger = 0;
 	zmq_setsockopt(zmq_publisher, ZMQ_LINGER, &linger, sizeof(linger));
 	
-	/* Set high water mark to prevent memory issues */
+	/* Set high water mark to prevent memory issues: past it, events for the
+	 * subscribers that are lagging behind are dropped, without us knowing */
 	int hwm = 1000;
 	zmq_setsockopt(zmq_publisher, ZMQ_SNDHWM, &hwm, sizeof(hwm));
 	
@@ -260,6 +1013,28 @@ int janus_zmqevh_init(const char *config_path) {
 	}
 	
 	JANUS_LOG(LOG_INFO, "ZeroMQ event handler publisher bound to %s\n", bind_address);
+	if(xpub) {
+		/* Until someone subscribes, the core doesn't need to send us anything */
+		JANUS_LOG(LOG_INFO, "Only publishing events someone is subscribed to\n");
+		if(topics && batching) {
+			/* Batches only have the type as topic, so ZeroMQ would never give them
+			 * to subscribers of a package or session, and neither do we match them */
+			JANUS_LOG(LOG_WARN, "Batches are published with the event type as topic: subscriptions to packages or sessions won't get any event\n");
+		}
+		events_mask = janus_zmqevh.events_mask;
+		subscriptions = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
+		janus_mutex_init(&subscriptions_mutex);
+		janus_mutex_lock(&subscriptions_mutex);
+		janus_zmqevh_subscriptions_snapshot();
+		janus_mutex_unlock(&subscriptions_mutex);
+		janus_zmqevh_subscriptions_mask();
+	}
+	if(batching) {
+		JANUS_LOG(LOG_INFO, "Publishing events in batches of up to %u (%s), waiting up to %"SCNi64"ms\n",
+			batch_size, batch_multipart ? "multipart" : "array", batch_window/1000);
+	}
+	if(topics)
+		JANUS_LOG(LOG_INFO, "Publishing events with topics (type/package%s)\n", topic_session ? "/session" : "");
 	
 	/* Start event thread */
 	GError *error = NULL;
@@ -270,6 +1045,20 @@ int janus_zmqevh_init(const char *config_path) {
 		g_error_free(error);
 		return -1;
 	}
+	/* Start the serialization workers, if any */
+	for(i = 0; i < workers_num; i++) {
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "zmqevh-w%u", i);
+		serializers[i].thread = g_thread_try_new(tname, janus_zmqevh_worker, &serializers[i], &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch a ZeroMQ event handler worker...\n",
+				error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			return -1;
+		}
+	}
+	if(workers_num > 0)
+		JANUS_LOG(LOG_INFO, "Serializing events in %u workers\n", workers_num);
 
 	g_atomic_int_set(&initialized, 1);
 	JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_ZMQEVH_NAME);
@@ -277,52 +1066,95 @@ int janus_zmqevh_init(const char *config_path) {
 	return 0;
 }
 
-/* Event thread */
+/* Event thread: the only one using the socket, it also serializes events when there are no workers */
 static void *janus_zmqevh_thread(void *data) {
 	JANUS_LOG(LOG_VERB, "Joining ZeroMQ event handler thread...\n");
+	janus_zeromq_thread_pin(thread_affinity);
 	
+	janus_zmqevh_serializer *serializer = (workers_num == 0) ? &serializers[0] : NULL;
+	zmq_pollitem_t items[2];
+	int num = 0;
+	items[num++] = (zmq_pollitem_t){ .socket = NULL, .fd = serializer ? serializer->ring.waker.fd : outbox_fd, .events = ZMQ_POLLIN, .revents = 0 };
+	if(xpub)
+		items[num++] = (zmq_pollitem_t){ .socket = zmq_publisher, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+	guint handled = 0;
 	while(!g_atomic_int_get(&stopping)) {
-		/* Wait for event with timeout */
-		janus_zmqevh_event *evt = g_async_queue_timeout_pop(events, 1000000); /* 1 second */
-		if(evt == NULL)
-			continue;
-			
-		if(evt->event == NULL) {
-			g_free(evt);
-			continue;
+		/* When busy, we still check every now and then whether subscriptions changed */
+		if(xpub && ++handled >= JANUS_ZMQEVH_SUBSCRIPTIONS_CHECK) {
+			janus_zmqevh_subscriptions_read();
+			handled = 0;
 		}
-		
-		/* Serialize event */
-		char *payload = json_dumps(evt->event, JSON_COMPACT);
-		if(payload == NULL) {
-			JANUS_LOG(LOG_ERR, "Failed to serialize JSON event\n");
-			json_decref(evt->event);
-			g_free(evt);
-			continue;
-		}
-		
-		JANUS_LOG(LOG_HUGE, "Publishing ZeroMQ event: %s\n", payload);
-		
-		/* Publish event with retry on EAGAIN */
-		int ret = zmq_send(zmq_publisher, payload, strlen(payload), ZMQ_DONTWAIT);
-		if(ret < 0) {
-			if(errno == EAGAIN) {
-				/* Socket buffer full - event dropped */
-				JANUS_LOG(LOG_WARN, "ZeroMQ publisher buffer full, event dropped\n");
-			} else {
-				JANUS_LOG(LOG_ERR, "Error publishing ZeroMQ event: %s\n", zmq_strerror(errno));
+		int timeout = 1000;
+		if(serializer == NULL) {
+			/* Publish what the workers serialized */
+			if(janus_zmqevh_outbox_flush() > 0)
+				continue;
+		} else {
+			gint64 queued = 0;
+			json_t *event = janus_zmqevh_ring_pop(&serializer->ring, &queued);
+			if(event != NULL) {
+				janus_zmqevh_serialize(serializer, event, queued);
+				continue;
+			}
+			/* Nothing else to add to the batches: publish them, unless we should wait for more */
+			int next = janus_zmqevh_batches_check(serializer, FALSE);
+			if(next >= 0)
+				timeout = next;
+			/* Tell producers we're going to sleep, and make sure nothing came in the meanwhile */
+			g_atomic_int_set(&serializer->ring.waker.sleeping, 1);
+			if(!janus_zmqevh_ring_is_empty(&serializer->ring)) {
+				g_atomic_int_set(&serializer->ring.waker.sleeping, 0);
+				continue;
 			}
 		}
-		
-		free(payload);
-		json_decref(evt->event);
-		g_free(evt);
+		if(zmq_poll(items, num, timeout) > 0) {
+			if(serializer != NULL && (items[0].revents & ZMQ_POLLIN))
+				janus_zmqevh_drain(items[0].fd);
+			if(num > 1 && (items[1].revents & ZMQ_POLLIN))
+				janus_zmqevh_subscriptions_read();
+		}
+		if(serializer != NULL)
+			g_atomic_int_set(&serializer->ring.waker.sleeping, 0);
 	}
+	/* Don't lose the events we were batching */
+	if(serializer != NULL)
+		janus_zmqevh_batches_check(serializer, TRUE);
 	
 	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ event handler thread...\n");
 	return NULL;
 }
 
+/* Serialization worker */
+static void *janus_zmqevh_worker(void *data) {
+	janus_zmqevh_serializer *serializer = (janus_zmqevh_serializer *)data;
+	JANUS_LOG(LOG_VERB, "Joining ZeroMQ event handler worker #%u...\n", serializer->index);
+	janus_zeromq_thread_pin(thread_affinity);
+	
+	struct pollfd fds[1] = { { .fd = serializer->ring.waker.fd, .events = POLLIN, .revents = 0 } };
+	while(!g_atomic_int_get(&stopping)) {
+		gint64 queued = 0;
+		json_t *event = janus_zmqevh_ring_pop(&serializer->ring, &queued);
+		if(event != NULL) {
+			janus_zmqevh_serialize(serializer, event, queued);
+			continue;
+		}
+		/* Nothing else to add to the batches: hand them over, unless we should wait for more */
+		int timeout = janus_zmqevh_batches_check(serializer, FALSE);
+		if(timeout < 0)
+			timeout = 1000;
+		/* Tell producers we're going to sleep, and make sure nothing came in the meanwhile */
+		g_atomic_int_set(&serializer->ring.waker.sleeping, 1);
+		if(janus_zmqevh_ring_is_empty(&serializer->ring) && poll(fds, 1, timeout) > 0)
+			janus_zmqevh_drain(fds[0].fd);
+		g_atomic_int_set(&serializer->ring.waker.sleeping, 0);
+	}
+	/* Don't lose the events we were batching */
+	janus_zmqevh_batches_check(serializer, TRUE);
+	
+	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ event handler worker #%u...\n", serializer->index);
+	return NULL;
+}
+
 /* Handle incoming event */
 void janus_zmqevh_incoming_event(json_t *event) {
 	if(!enabled || g_atomic_int_get(&stopping))
@@ -331,12 +1163,32 @@ void janus_zmqevh_incoming_event(json_t *event) {
 	if(event == NULL)
 		return;
 	
-	/* Queue the event */
-	janus_zmqevh_event *evt = g_malloc(sizeof(janus_zmqevh_event));
-	evt->event = event;
-	json_incref(event);
+	/* With workers, events for the same session (or handle) always go to
+	 * the same one, which keeps them in order; events that have neither
+	 * (e.g., core events) all go to the first one */
+	janus_zmqevh_serializer *serializer = &serializers[0];
+	if(serializers_num > 1) {
+		guint64 id = json_integer_value(json_object_get(event, "session_id"));
+		if(id == 0)
+			id = json_integer_value(json_object_get(event, "handle_id"));
+		serializer = &serializers[id % serializers_num];
+	}
 	
-	g_async_queue_push(events, evt);
+	/* Queue the event: this never allocates nor blocks, and if the ring
+	 * is full, the drop policy tells us which event to get rid of */
+	json_incref(event);
+	gint64 now = g_get_monotonic_time();
+	while(!janus_zmqevh_ring_push(&serializer->ring, event, now)) {
+		json_t *oldest = NULL;
+		if(drop_policy != janus_zmqevh_drop_oldest || (oldest = janus_zmqevh_ring_pop(&serializer->ring, NULL)) == NULL) {
+			g_atomic_int_inc(&dropped_newest);
+			json_decref(event);
+			return;
+		}
+		g_atomic_int_inc(&dropped_oldest);
+		json_decref(oldest);
+	}
+	janus_zmqevh_wakeup(&serializer->ring.waker);
 }
 
 /* Handle request */
@@ -360,6 +1212,48 @@ json_t *janus_zmqevh_handle_request(json_t *request) {
 		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", address, port);
 		json_object_set_new(info, "address", json_string(bind_address));
 		json_object_set_new(info, "events_mask", json_integer(janus_zmqevh.events_mask));
+		json_object_set_new(info, "workers", json_integer(workers_num));
+		json_object_set_new(info, "queue_size", json_integer(ring_size));
+		guint i = 0, queued = 0;
+		gint64 batch_wait = 0;
+		for(i = 0; i < serializers_num; i++) {
+			queued += janus_zmqevh_ring_size(&serializers[i].ring);
+			batch_wait = MAX(batch_wait, serializers[i].batch_wait);
+		}
+		json_object_set_new(info, "queued", json_integer(queued));
+		json_object_set_new(info, "drop_policy", json_string(janus_zmqevh_drop_policy_str(drop_policy)));
+		if(drop_policy == janus_zmqevh_drop_age)
+			json_object_set_new(info, "max_age", json_integer(max_age/1000));
+		json_t *dropped = json_object();
+		json_object_set_new(dropped, "newest", json_integer(g_atomic_int_get(&dropped_newest)));
+		json_object_set_new(dropped, "oldest", json_integer(g_atomic_int_get(&dropped_oldest)));
+		json_object_set_new(dropped, "expired", json_integer(g_atomic_int_get(&dropped_expired)));
+		if(workers_num > 0)
+			json_object_set_new(dropped, "outbox_full", json_integer(g_atomic_int_get(&dropped_outbox)));
+		json_object_set_new(info, "dropped", dropped);
+		json_object_set_new(info, "events_published", json_integer(g_atomic_int_get(&events_published)));
+		json_object_set_new(info, "topics", topics ? json_true() : json_false());
+		json_object_set_new(info, "xpub", xpub ? json_true() : json_false());
+		if(xpub) {
+			json_t *list = json_array();
+			janus_mutex_lock(&subscriptions_mutex);
+			GHashTableIter iter;
+			gpointer key = NULL;
+			g_hash_table_iter_init(&iter, subscriptions);
+			while(g_hash_table_iter_next(&iter, &key, NULL))
+				json_array_append_new(list, json_string((const char *)key));
+			janus_mutex_unlock(&subscriptions_mutex);
+			json_object_set_new(info, "subscriptions", list);
+			json_object_set_new(info, "events_unsubscribed", json_integer(g_atomic_int_get(&events_unsubscribed)));
+		}
+		json_object_set_new(info, "batching", batching ? json_true() : json_false());
+		if(batching) {
+			json_object_set_new(info, "batch_format", json_string(batch_multipart ? "multipart" : "array"));
+			json_object_set_new(info, "batch_size", json_integer(batch_size));
+			json_object_set_new(info, "batch_window", json_integer(batch_window/1000));
+			json_object_set_new(info, "batch_wait", json_integer(batch_wait));
+			json_object_set_new(info, "batches_published", json_integer(g_atomic_int_get(&batches_published)));
+		}
 	}
 	
 	return info;
@@ -371,23 +1265,65 @@ void janus_zmqevh_destroy(void) {
 		return;
 	g_atomic_int_set(&stopping, 1);
 
-	/* Wait for event thread to stop */
+	/* Wait for the workers and the event thread to stop (waking them up, in case they're sleeping) */
+	guint i = 0, j = 0;
+	for(i = 0; i < serializers_num; i++) {
+		if(serializers[i].ring.waker.fd != -1)
+			janus_zmqevh_signal(serializers[i].ring.waker.fd);
+		if(serializers[i].thread != NULL) {
+			g_thread_join(serializers[i].thread);
+			serializers[i].thread = NULL;
+		}
+	}
+	if(outbox_fd != -1)
+		janus_zmqevh_signal(outbox_fd);
 	if(event_thread != NULL) {
 		g_thread_join(event_thread);
 		event_thread = NULL;
 	}
+	/* Publish what the workers handed over last: the socket is ours, now */
+	if(outbox_fd != -1) {
+		janus_zmqevh_outbox_flush();
+		close(outbox_fd);
+		outbox_fd = -1;
+	}
 
-	/* Clear event queue */
-	if(events != NULL) {
-		janus_zmqevh_event *evt = NULL;
-		while((evt = g_async_queue_try_pop(events)) != NULL) {
-			if(evt->event)
-				json_decref(evt->event);
-			g_free(evt);
+	/* Clear the serializers */
+	for(i = 0; i < serializers_num; i++) {
+		janus_zmqevh_serializer *serializer = &serializers[i];
+		janus_zmqevh_ring_destroy(&serializer->ring);
+		for(j = 0; serializer->batches != NULL && j < batches_num; j++) {
+			if(serializer->batches[j].buffer != NULL)
+				g_string_free(serializer->batches[j].buffer, TRUE);
+			if(serializer->batches[j].frames != NULL)
+				g_ptr_array_free(serializer->batches[j].frames, TRUE);
 		}
-		g_async_queue_unref(events);
-		events = NULL;
+		g_free(serializer->batches);
+		if(serializer->subscriptions != NULL)
+			g_ptr_array_unref(serializer->subscriptions);
+	}
+	g_free(serializers);
+	serializers = NULL;
+	serializers_num = 0;
+	workers_num = 0;
+	ring_size = 8192;
+	drop_policy = janus_zmqevh_drop_newest;
+	batches_num = 0;
+	topics = FALSE;
+	topic_session = TRUE;
+	if(subscriptions != NULL) {
+		g_hash_table_destroy(subscriptions);
+		subscriptions = NULL;
+		janus_mutex_clear(&subscriptions_mutex);
+	}
+	if(subscriptions_snapshot != NULL) {
+		g_ptr_array_unref(subscriptions_snapshot);
+		subscriptions_snapshot = NULL;
 	}
+	xpub = FALSE;
+	batching = FALSE;
+	batch_multipart = FALSE;
+	max_age = 2*G_USEC_PER_SEC;
 
 	/* Close publisher socket */
 	if(zmq_publisher != NULL) {
@@ -397,9 +1333,14 @@ void janus_zmqevh_destroy(void) {
 
 	/* Destroy context */
 	if(zmq_context != NULL) {
-		zmq_ctx_destroy(zmq_context);
+		janus_zeromq_context_unref(JANUS_ZMQEVH_NAME);
 		zmq_context = NULL;
 	}
+	g_free((char *)context_settings.io_affinity);
+	g_free((char *)context_settings.io_sched_policy);
+	memset(&context_settings, 0, sizeof(context_settings));
+	g_free(thread_affinity);
+	thread_affinity = NULL;
 
 	/* Cleanup */
 	g_free(address);
@@ -15,6 +15,9 @@
 
 #include <zmq.h>
 #include <arpa/inet.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "transport.h"
 #include "debug.h"
@@ -22,6 +25,7 @@
 #include "config.h"
 #include "mutex.h"
 #include "utils.h"
+#include "zeromq_context.h"
 
 
 /* Transport plugin information */
@@ -89,31 +93,360 @@ static janus_transport_callbacks *gateway = NULL;
 static gboolean zeromq_janus_api_enabled = FALSE;
 static gboolean zeromq_admin_api_enabled = FALSE;
 
-/* ZeroMQ context and sockets */
+/* ZeroMQ context (shared with the event handler) and sockets */
 static void *zmq_context = NULL;
-static void *zmq_socket = NULL;
+static janus_zeromq_context_settings context_settings = { 0 };
+/* CPUs the threads of the plugin should be pinned to, if any */
+static char *thread_affinity = NULL;
+static void *zmq_janus_socket = NULL;
 static void *zmq_admin_socket = NULL;
+/* Optional PUB socket asynchronous session events are published on, using
+ * "<session_id>/" as topic, so that clients can subscribe to their sessions */
+static void *zmq_publish_socket = NULL;
+static gint events_published = 0;
+/* Socket types (ZMQ_REP or ZMQ_ROUTER) for the two APIs */
+static int janus_socket_type = ZMQ_REP, admin_socket_type = ZMQ_REP;
+/* Messages we dropped because the peer wasn't reading them: we never
+ * block the thread owning the sockets waiting for a slow peer */
+static gint messages_dropped = 0;
 
-/* Threads */
-static GThread *zeromq_thread = NULL, *zeromq_admin_thread = NULL;
+/* Inproc socket used to wake the ZeroMQ thread up when we're shutting down */
+static void *zmq_control_socket = NULL;
+#define JANUS_ZEROMQ_CONTROL_ENDPOINT	"inproc://janus-zeromq-control"
+/* Monitors of the ROUTER sockets, telling us when peers disconnect: after
+ * disconnect_grace, peers that didn't come back are released, together
+ * with their sessions. ZMTP heartbeats help detecting dead peers too */
+static gboolean monitor = FALSE;
+static void *zmq_janus_monitor = NULL, *zmq_admin_monitor = NULL;
+#define JANUS_ZEROMQ_JANUS_MONITOR_ENDPOINT	"inproc://janus-zeromq-monitor-janus"
+#define JANUS_ZEROMQ_ADMIN_MONITOR_ENDPOINT	"inproc://janus-zeromq-monitor-admin"
+static gint64 disconnect_grace = 5*G_USEC_PER_SEC;
+static int heartbeat_interval = 0, heartbeat_timeout = 0, heartbeat_ttl = 0;	/* In milliseconds */
+/* Maximum number of requests read from a socket before looking at the others again */
+#define JANUS_ZEROMQ_READ_BUDGET		64
+
+/* Thread owning all the sockets */
+static GThread *zeromq_thread = NULL;
 static void *janus_zeromq_thread(void *data);
-static void *janus_zeromq_admin_thread(void *data);
 
-/* No need for custom session structure - we use basic transport_session */
-static janus_mutex sessions_mutex;
-static GHashTable *sessions = NULL;
+/* Codecs requests and replies can be encoded with: the codec of an API
+ * can be fixed, or automatically detected for each peer from the first
+ * byte of its requests (MessagePack maps/arrays never look like JSON) */
+typedef enum janus_zeromq_codec {
+	janus_zeromq_codec_json = 0,
+	janus_zeromq_codec_msgpack,
+	janus_zeromq_codec_auto
+} janus_zeromq_codec;
+static janus_zeromq_codec janus_codec = janus_zeromq_codec_json, admin_codec = janus_zeromq_codec_json;
+/* Maximum nesting we accept when decoding MessagePack */
+#define JANUS_ZEROMQ_MSGPACK_MAX_DEPTH	64
+
+/* Envelope of a message received on a ROUTER socket */
+typedef struct janus_zeromq_envelope {
+	gboolean delimiter;		/* Whether the peer uses an empty delimiter frame (e.g., REQ) */
+	size_t identity_len;	/* Size of the routing identity (0 in REP mode) */
+	guint8 identity[255];	/* Routing identity ROUTER assigned to (or got from) the peer */
+} janus_zeromq_envelope;
+
+/* ZeroMQ peer: each peer has a single transport session that is reused
+ * for all its requests, and whose transport_data points back to the peer,
+ * so that replies and asynchronous events can be routed back to the right
+ * DEALER/REQ client in any order. In REP mode, we can't tell peers apart,
+ * and so there's a single peer (with an empty identity) per API. Peers are
+ * refcounted, and recycled via a pool when nothing references them anymore */
+typedef struct janus_zeromq_client {
+	janus_transport_session transport;	/* Transport session the core knows this peer by */
+	gboolean admin;						/* Whether this peer is on the Admin or Janus API */
+	janus_zeromq_envelope envelope;		/* How to route messages to this peer */
+	gint64 last_activity;				/* When we last got a request from this peer (ZeroMQ thread only) */
+	int fd;								/* Connection we last got a request from (ZeroMQ thread only) */
+	gint64 disconnected;				/* When that connection went away, 0 if it didn't (ZeroMQ thread only) */
+	volatile gint sessions;				/* Number of Janus sessions this peer currently owns */
+	volatile gint codec;				/* Codec this peer uses (janus_zeromq_codec) */
+	volatile gint inflight;				/* Requests from this peer still waiting for a reply */
+	GQueue pending;						/* Requests waiting for their turn to be dispatched (ZeroMQ thread only) */
+	guint weight;						/* Share of the workers this peer is entitled to (0 if not known yet) */
+	gint deficit;						/* Bytes this peer can still dispatch in this round */
+	gboolean scheduled;					/* Whether this peer is in the list of peers with pending requests */
+	struct janus_zeromq_buffer *batch;	/* Replies being coalesced for this peer (ZeroMQ thread only) */
+	guint batch_count;					/* Number of replies in the batch */
+	gint64 batch_deadline;				/* When the batch must be sent, at the latest */
+	volatile gint ref;					/* Reference counter */
+} janus_zeromq_client;
+/* Peers we know about, indexed by identity (only accessed by the ZeroMQ thread) */
+static GHashTable *janus_peers = NULL, *admin_peers = NULL;
+/* How often we look for peers that went idle, and how long before they're considered gone */
+#define JANUS_ZEROMQ_PEERS_SWEEP_INTERVAL	(10*G_USEC_PER_SEC)
+#define JANUS_ZEROMQ_PEER_IDLE_TIMEOUT		(120*G_USEC_PER_SEC)
+
+/* Lock-free pools of recycled objects (e.g., buffers and peers): each slot
+ * is taken or filled with a CAS, so that any thread can use them */
+#define JANUS_ZEROMQ_POOL_SIZE		64
+static gpointer buffers_pool[JANUS_ZEROMQ_POOL_SIZE];
+static gpointer clients_pool[JANUS_ZEROMQ_POOL_SIZE];
+
+/* Growable buffer outgoing messages are serialized to: buffers are handed
+ * to ZeroMQ without copying them, and recycled when ZeroMQ is done with them */
+typedef struct janus_zeromq_buffer {
+	char *data;		/* Serialized message */
+	size_t len;		/* Size of the serialized message */
+	size_t size;	/* Allocated size */
+} janus_zeromq_buffer;
+#define JANUS_ZEROMQ_BUFFER_INITIAL_SIZE	4096
+/* Larger buffers (e.g., huge Admin API replies) are freed, rather than recycled */
+#define JANUS_ZEROMQ_BUFFER_MAX_POOLED		(256*1024)
+
+/* Chunked replies: in ROUTER mode, replies larger than chunk_size are
+ * serialized straight into chunk_size frames, each sent as a message of
+ * its own (so that other peers are served in between), with a header
+ * frame ("chunk <reply id> <index> more|last") preceding the payload.
+ * If a reply is aborted, the peer gets a last "chunk <reply id> <index> abort"
+ * header with an empty payload, so that it can discard what it got so far.
+ * The thread serializing a reply waits when chunk_window chunks of it
+ * are still queued, which keeps the memory a reply takes bounded: if the
+ * peer doesn't drain any of them within chunk_timeout, the reply is aborted */
+static size_t chunk_size = 0;		/* 0 means replies are never chunked */
+static gint chunk_window = 4;
+static gint64 chunk_timeout = G_USEC_PER_SEC;	/* How long a core thread may wait, at most */
+static volatile gint chunked_replies = 0;
+static guint chunks_blocked_pass = 0;
+typedef struct janus_zeromq_stream {
+	guint id;				/* Reply ID, as in the chunk headers */
+	guint next;				/* Index of the next chunk (serializing thread only) */
+	gint queued;			/* Chunks queued but not sent yet */
+	gboolean failed;		/* Whether a chunk couldn't be sent, and the reply should be aborted */
+	guint blocked;			/* Chunks waiting for the peer to drain (ZeroMQ thread only) */
+	guint blocked_pass;		/* Last retry pass a chunk of this reply was still blocked (ZeroMQ thread only) */
+	gint64 blocked_since;	/* When the peer last took a chunk of this reply, if blocked (ZeroMQ thread only) */
+	gboolean aborted;		/* Whether we told the peer the reply was aborted (ZeroMQ thread only) */
+	janus_mutex mutex;
+	janus_condition cond;
+	volatile gint ref;		/* Reference counter */
+} janus_zeromq_stream;
+/* Chunks the peer couldn't take yet, in order (ZeroMQ thread only) */
+static GQueue *chunks_blocked = NULL;
+/* How often we retry sending blocked chunks (in milliseconds) */
+#define JANUS_ZEROMQ_CHUNKS_RETRY_INTERVAL	10
+
+/* Request ID we pass to the core, which we get back with the reply */
+typedef struct janus_zeromq_request_id {
+	gint64 received;	/* When the request was received (0 if this is not one) */
+	guint verb;			/* Index of the request verb in stats_verbs */
+	gboolean batched;	/* Whether the request came in a batch, so its reply is coalesced */
+} janus_zeromq_request_id;
+
+/* Outgoing message, serialized by the thread that produced it and then
+ * queued for the thread that owns the socket, as ZeroMQ sockets are not
+ * thread-safe and must only ever be used by a single thread */
+typedef struct janus_zeromq_outgoing {
+	struct janus_zeromq_outgoing *next;	/* Next message in the mailbox */
+	gboolean admin;						/* Whether this is for the Admin or Janus API */
+	janus_zeromq_client *client;		/* Peer to send this to (a reference) */
+	janus_zeromq_buffer *buffer;		/* Serialized message */
+	char *transaction;					/* Transaction of the message, if it must be cached */
+	janus_zeromq_request_id request;	/* Request this is a reply to, if any, to time it and batch it */
+	guint64 topic;						/* Session to publish this event for, 0 if it's not a publication */
+	janus_zeromq_stream *stream;		/* Chunked reply this is a chunk of, if any (a reference) */
+	guint chunk;						/* Index of the chunk in the reply */
+	gboolean last;						/* Whether this is the last chunk of the reply */
+} janus_zeromq_outgoing;
+
+/* Lock-free multiple producers/single consumer mailbox: producers push
+ * to the head with a CAS, while the socket owner detaches the whole list
+ * at once and sends everything in it, in order, before polling again.
+ * The eventfd is only signalled on the empty->non-empty transition */
+typedef struct janus_zeromq_mailbox {
+	janus_zeromq_outgoing *head;	/* Most recently pushed message (LIFO) */
+	int fd;							/* eventfd used to wake the socket owner */
+} janus_zeromq_mailbox;
+static janus_zeromq_mailbox mailbox = { .head = NULL, .fd = -1 };
+
+/* Incoming request, read by the thread that owns the socket and then
+ * either processed inline or handed to one of the workers */
+typedef struct janus_zeromq_request {
+	gboolean admin;					/* Whether this is an Admin API request */
+	janus_zeromq_client *client;	/* Peer that sent this (a reference) */
+	guint lane;						/* Priority lane this request was classified in */
+	gint64 received;				/* When we received the request */
+	zmq_msg_t message;				/* Frame containing the request, which is parsed in place */
+} janus_zeromq_request;
+static janus_zeromq_request exit_request;
+
+/* Priority lanes: light requests the latency of which matters (keepalives,
+ * pings) are classified on receipt, and get their own lane, so that they
+ * never wait behind heavy requests. Trickle candidates are not among them,
+ * as they must not overtake the offer or answer of the same handle, which
+ * the core may not have seen yet. A worker serves at most priority_budget
+ * of them in a row when there's something else to do */
+#define JANUS_ZEROMQ_LANE_PRIORITY	0
+#define JANUS_ZEROMQ_LANE_NORMAL	1
+#define JANUS_ZEROMQ_LANES			2
+static guint priority_budget = 8;	/* 0 means there's a single lane */
+
+/* Workers parsing requests and passing them to the core: requests for the
+ * same session (or from the same peer, if there's no session yet) always
+ * end up on the same worker, which preserves their ordering within a lane */
+typedef struct janus_zeromq_worker_queue {
+	janus_mutex mutex;
+	janus_condition cond;
+	GQueue lanes[JANUS_ZEROMQ_LANES];	/* Requests waiting for this worker, per lane */
+	guint burst;						/* Priority requests served in a row */
+} janus_zeromq_worker_queue;
+static guint workers_num = 0;
+static GThread **workers = NULL;
+static janus_zeromq_worker_queue *worker_queues = NULL;
+static gint worker_next = 0;
+static void *janus_zeromq_worker(void *data);
+
+/* Admission control: requests from a peer that already has too many
+ * requests in flight are rejected right away, and so are all Janus API
+ * requests while the worker queues are above the high watermark, until
+ * they drain below the low watermark. Rejected requests get an error
+ * telling the peer how long to wait before retrying */
+static guint max_inflight = 0;				/* Per peer, 0 means no limit */
+static guint queue_high_watermark = 0;		/* Queued requests, 0 means no limit */
+static guint queue_low_watermark = 0;
+static guint retry_after = 100;				/* In milliseconds */
+static gint requests_queued = 0;
+static volatile gint overloaded = 0;		/* Only changed by the ZeroMQ thread */
+static gint requests_shed = 0;
+/* High water marks of the API sockets, 0 means the ZeroMQ default */
+static int recv_hwm = 0, send_hwm = 0;
+
+/* Fair scheduling: when enabled, requests are queued per peer, and only
+ * dispatched to the workers as long as there's less than fair_window
+ * requests queued there. Peers with pending requests are served with
+ * deficit round robin, where each round a peer can dispatch up to its
+ * weight times the quantum in bytes, so that a peer flooding us only
+ * gets its share of the workers, rather than delaying everybody else */
+static gboolean fair = FALSE;
+static guint fair_window = 0;
+#define JANUS_ZEROMQ_FAIR_QUANTUM	4096
+static GHashTable *fair_weights = NULL;	/* Identity or address -> weight */
+static GQueue *fair_peers = NULL;		/* Peers with pending requests, in round robin order (ZeroMQ thread only) */
+static gboolean fair_resume = FALSE;	/* Whether the first peer in the list was interrupted by a full window */
+static guint requests_pending = 0;		/* Requests in the queues of the peers (ZeroMQ thread only) */
+
+/* Idempotency: when enabled, we keep track of the transactions of the
+ * requests each peer sent recently, and of the last reply we sent for
+ * them, so that retries (e.g., Lazy Pirate clients resending a request
+ * after a timeout) are not passed to the core again: retries of requests
+ * still in flight are dropped, while retries of requests that have been
+ * answered (or rejected) get the same reply again. Only ROUTER sockets
+ * are covered, as REP peers have no identity we can tell them apart by,
+ * and a REP socket can't drop a request without replying to it. Entries
+ * expire after a fixed time (rejections after the retry hint we sent),
+ * and the oldest ones are evicted when the cache is full (ZeroMQ thread only) */
+typedef struct janus_zeromq_idempotency_entry {
+	GBytes *key;						/* API, peer identity and transaction */
+	gint64 expires;						/* When we can forget about the request */
+	GList *link;						/* Link in the queue, to remove stale entries */
+	struct janus_zeromq_buffer *reply;	/* Copy of the last reply, NULL while in flight */
+} janus_zeromq_idempotency_entry;
+static gboolean idempotency = FALSE;
+static guint idempotency_size = 10000;
+static gint64 idempotency_ttl = 30*G_USEC_PER_SEC;
+static GHashTable *idempotency_cache = NULL;	/* key -> janus_zeromq_idempotency_entry */
+static GQueue *idempotency_queue = NULL;		/* Entries, oldest first */
+static gint requests_retried = 0;
+
+/* Statistics: each thread updates its own counters and latency histograms
+ * (so no locking or atomics are needed), which are only summed up when
+ * someone asks for them via query_transport. Histograms are log-linear,
+ * as HDR histograms: values (in microseconds) below 8 have their own
+ * bucket, while each power of two above is split in 8 buckets, which
+ * keeps the error below 12.5% whatever the value, up to ~16 seconds */
+static const char *stats_verbs[] = {
+	"create", "attach", "message", "trickle", "keepalive", "detach", "destroy", "hangup",
+	"claim", "info", "ping", "list_sessions", "list_handles", "handle_info", "other"
+};
+#define JANUS_ZEROMQ_STATS_VERBS		(sizeof(stats_verbs)/sizeof(*stats_verbs))
+#define JANUS_ZEROMQ_HISTOGRAM_MAX_EXP	24
+#define JANUS_ZEROMQ_HISTOGRAM_BUCKETS	((JANUS_ZEROMQ_HISTOGRAM_MAX_EXP - 1) * 8)
+typedef struct janus_zeromq_histogram {
+	guint64 count;
+	guint64 sum;
+	guint64 max;
+	guint64 buckets[JANUS_ZEROMQ_HISTOGRAM_BUCKETS];
+} janus_zeromq_histogram;
+typedef struct janus_zeromq_stats {
+	struct {
+		guint64 bytes_in, bytes_out;
+		guint64 parse_failures;
+		struct {
+			guint64 received;
+			janus_zeromq_histogram queue;	/* From receiving the request to passing it to the core */
+			janus_zeromq_histogram reply;	/* From receiving the request to picking the reply up for sending */
+		} verbs[JANUS_ZEROMQ_STATS_VERBS];
+	} api[2];	/* Janus API (0) and Admin API (1) */
+} janus_zeromq_stats;
+static void janus_zeromq_stats_retire(gpointer data);
+static GPrivate stats_key = G_PRIVATE_INIT(janus_zeromq_stats_retire);
+/* Counters of all live threads, and the sum of those of the threads that
+ * exited already, which are freed then. Only the threads of the plugin
+ * (the one owning the sockets, and the workers) keep counters, never the
+ * ones of the core, so they're all retired before the plugin is destroyed,
+ * and the totals keep on counting across restarts. The mutex is only used
+ * when threads come and go, or when summing the counters up */
+static janus_mutex stats_mutex;
+static GList *stats_list = NULL;
+static janus_zeromq_stats *stats_retired = NULL;
+/* Batching: peers can send a JSON array of up to batch_max requests rather
+ * than a single request, in which case the replies to those requests are
+ * coalesced in JSON arrays too, sent when either batch_size replies are
+ * ready, or batch_window expired (replies to single requests, and events,
+ * are still sent as they are) */
+static gboolean batching = FALSE;
+static guint batch_size = 64;
+static guint batch_max = 256;
+static gint64 batch_window = 5000;	/* In microseconds */
+/* Pending batches, in the order they were started (ZeroMQ thread only):
+ * as the window is the same for all, deadlines are always in order too */
+typedef struct janus_zeromq_batch_timer {
+	struct janus_zeromq_client *client;	/* Peer the batch is for (a reference) */
+	gint64 deadline;					/* Deadline of the batch when this was queued */
+} janus_zeromq_batch_timer;
+static GQueue *batch_timers = NULL;
+/* Peers that disconnected, in the order they did (ZeroMQ thread only): as
+ * the grace period is the same for all, deadlines are always in order too */
+typedef struct janus_zeromq_gone_timer {
+	struct janus_zeromq_client *client;	/* Peer that disconnected (a reference) */
+	gint64 disconnected;				/* When it disconnected */
+} janus_zeromq_gone_timer;
+static GQueue *gone_timers = NULL;
+
+/* Registry of the Janus sessions created via this transport, mapping each
+ * session to the peer that owns it, so that events for a session can be
+ * routed to the right peer. It's lock-striped by session ID, so that the
+ * many core threads looking things up don't all contend on the same mutex */
+typedef struct janus_zeromq_session {
+	guint64 session_id;					/* Janus session ID */
+	janus_zeromq_client *client;		/* Peer owning the session (a reference) */
+} janus_zeromq_session;
+#define JANUS_ZEROMQ_SESSIONS_STRIPES	16
+typedef struct janus_zeromq_sessions_stripe {
+	janus_mutex mutex;
+	GHashTable *sessions;	/* session_id -> janus_zeromq_session */
+} janus_zeromq_sessions_stripe;
+static janus_zeromq_sessions_stripe sessions[JANUS_ZEROMQ_SESSIONS_STRIPES];
+#define janus_zeromq_sessions_stripe_for(id)	(&sessions[(id) % JANUS_ZEROMQ_SESSIONS_STRIPES])
 
 /* Configuration */
 static char *address = NULL;
 static uint16_t port = 0;
 static char *admin_address = NULL;
 static uint16_t admin_port = 0;
+static char *publish_address = NULL;
+static uint16_t publish_port = 0;
+/* Additional endpoints (e.g., ipc:// or inproc://) the API sockets are bound to */
+static gchar **endpoints = NULL, **admin_endpoints = NULL;
 
 
 /* Error codes */
 #define JANUS_ZEROMQ_ERROR_UNKNOWN				499
 #define JANUS_ZEROMQ_ERROR_INVALID_REQUEST		498
 #define JANUS_ZEROMQ_ERROR_INITIALIZATION		497
+#define JANUS_ZEROMQ_ERROR_OVERLOADED			496
 
 
 /* Plugin implementation */
@@ -133,32 +466,1744 @@ const char *janus_zeromq_get_description(void) {
 	return JANUS_ZEROMQ_DESCRIPTION;
 }
 
-const char *janus_zeromq_get_name(void) {
-	return JANUS_ZEROMQ_NAME;
+const char *janus_zeromq_get_name(void) {
+	return JANUS_ZEROMQ_NAME;
+}
+
+const char *janus_zeromq_get_author(void) {
+	return JANUS_ZEROMQ_AUTHOR;
+}
+
+const char *janus_zeromq_get_package(void) {
+	return JANUS_ZEROMQ_PACKAGE;
+}
+
+gboolean janus_zeromq_is_janus_api_enabled(void) {
+	return zeromq_janus_api_enabled;
+}
+
+gboolean janus_zeromq_is_admin_api_enabled(void) {
+	return zeromq_admin_api_enabled;
+}
+
+/* Pools management */
+static gpointer janus_zeromq_pool_get(gpointer *pool) {
+	guint i = 0;
+	for(i = 0; i < JANUS_ZEROMQ_POOL_SIZE; i++) {
+		gpointer item = g_atomic_pointer_get(&pool[i]);
+		if(item != NULL && g_atomic_pointer_compare_and_exchange(&pool[i], item, NULL))
+			return item;
+	}
+	return NULL;
+}
+
+static gboolean janus_zeromq_pool_put(gpointer *pool, gpointer item) {
+	guint i = 0;
+	for(i = 0; i < JANUS_ZEROMQ_POOL_SIZE; i++) {
+		if(g_atomic_pointer_get(&pool[i]) == NULL &&
+				g_atomic_pointer_compare_and_exchange(&pool[i], NULL, item))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void janus_zeromq_pool_cleanup(gpointer *pool, GDestroyNotify free_func) {
+	gpointer item = NULL;
+	while((item = janus_zeromq_pool_get(pool)) != NULL)
+		free_func(item);
+}
+
+/* Peers management */
+static janus_zeromq_client *janus_zeromq_client_new(gboolean admin, janus_zeromq_envelope *envelope) {
+	janus_zeromq_client *client = janus_zeromq_pool_get(clients_pool);
+	if(client == NULL)
+		client = g_malloc(sizeof(janus_zeromq_client));
+	memset(client, 0, sizeof(janus_zeromq_client));
+	client->transport.transport_p = &janus_zeromq_transport;
+	client->transport.transport_data = client;
+	client->admin = admin;
+	client->envelope = *envelope;
+	client->fd = -1;
+	g_atomic_int_set(&client->ref, 1);
+	return client;
+}
+
+static void janus_zeromq_client_ref(janus_zeromq_client *client) {
+	if(client != NULL)
+		g_atomic_int_inc(&client->ref);
+}
+
+static void janus_zeromq_client_unref(janus_zeromq_client *client) {
+	if(client == NULL || !g_atomic_int_dec_and_test(&client->ref))
+		return;
+	if(!janus_zeromq_pool_put(clients_pool, client))
+		g_free(client);
+}
+
+/* Helper to account for requests from a peer that got a reply (or never will) */
+static void janus_zeromq_client_settle(janus_zeromq_client *client, gint count) {
+	gint inflight = 0;
+	do {
+		inflight = g_atomic_int_get(&client->inflight);
+		if(inflight == 0)
+			return;
+	} while(!g_atomic_int_compare_and_exchange(&client->inflight, inflight, MAX(0, inflight - count)));
+}
+
+static guint janus_zeromq_client_hash(gconstpointer data) {
+	const janus_zeromq_client *client = (const janus_zeromq_client *)data;
+	guint hash = 5381;
+	size_t i = 0;
+	for(i = 0; i < client->envelope.identity_len; i++)
+		hash = hash * 33 + client->envelope.identity[i];
+	return hash;
+}
+
+static gboolean janus_zeromq_client_equal(gconstpointer a, gconstpointer b) {
+	const janus_zeromq_client *c1 = (const janus_zeromq_client *)a, *c2 = (const janus_zeromq_client *)b;
+	return c1->envelope.identity_len == c2->envelope.identity_len &&
+		!memcmp(c1->envelope.identity, c2->envelope.identity, c1->envelope.identity_len);
+}
+
+/* Returns a reference to the peer with this envelope, creating it if it's
+ * a new one: only called by the ZeroMQ thread, which owns the peers tables */
+static janus_zeromq_client *janus_zeromq_client_get(gboolean admin, janus_zeromq_envelope *envelope) {
+	GHashTable *peers = admin ? admin_peers : janus_peers;
+	janus_zeromq_client *client = NULL;
+	janus_zeromq_client lookup;
+	lookup.envelope.identity_len = envelope->identity_len;
+	memcpy(lookup.envelope.identity, envelope->identity, envelope->identity_len);
+	client = g_hash_table_lookup(peers, &lookup);
+	if(client == NULL) {
+		client = janus_zeromq_client_new(admin, envelope);
+		/* The table owns the first reference */
+		g_hash_table_add(peers, client);
+		JANUS_LOG(LOG_VERB, "New ZeroMQ %speer (%zu peers)\n", admin ? "admin " : "", (size_t)g_hash_table_size(peers));
+	}
+	/* The delimiter may change if the peer reconnected with a different socket type */
+	client->envelope.delimiter = envelope->delimiter;
+	client->last_activity = g_get_monotonic_time();
+	janus_zeromq_client_ref(client);
+	return client;
+}
+
+/* Forgets about peers that own no session and didn't send anything in a
+ * while: the core doesn't keep references to transport sessions it's not
+ * using anymore, so we can safely reuse them (only called by the ZeroMQ thread) */
+static gboolean janus_zeromq_client_is_idle(gpointer key, gpointer value, gpointer user_data) {
+	janus_zeromq_client *client = (janus_zeromq_client *)key;
+	gint64 now = *(gint64 *)user_data;
+	return g_atomic_int_get(&client->sessions) == 0 && now - client->last_activity > JANUS_ZEROMQ_PEER_IDLE_TIMEOUT;
+}
+
+static void janus_zeromq_clients_sweep(void) {
+	gint64 now = g_get_monotonic_time();
+	guint removed = 0;
+	if(janus_peers != NULL)
+		removed += g_hash_table_foreach_remove(janus_peers, janus_zeromq_client_is_idle, &now);
+	if(admin_peers != NULL)
+		removed += g_hash_table_foreach_remove(admin_peers, janus_zeromq_client_is_idle, &now);
+	if(removed > 0)
+		JANUS_LOG(LOG_VERB, "Released %u idle ZeroMQ peers\n", removed);
+}
+
+/* Helper to start monitoring a socket, returning the socket to read events from */
+static void *janus_zeromq_create_monitor(void *socket, const char *endpoint, gboolean admin) {
+	if(zmq_socket_monitor(socket, endpoint, ZMQ_EVENT_ACCEPTED | ZMQ_EVENT_DISCONNECTED) < 0) {
+		JANUS_LOG(LOG_ERR, "Could not monitor ZeroMQ %ssocket: %s\n", admin ? "admin " : "", zmq_strerror(errno));
+		return NULL;
+	}
+	void *monitor_socket = zmq_socket(zmq_context, ZMQ_PAIR);
+	if(monitor_socket == NULL || zmq_connect(monitor_socket, endpoint) < 0) {
+		JANUS_LOG(LOG_ERR, "Could not connect to the ZeroMQ %ssocket monitor: %s\n", admin ? "admin " : "", zmq_strerror(errno));
+		if(monitor_socket != NULL)
+			zmq_close(monitor_socket);
+		zmq_socket_monitor(socket, NULL, 0);
+		return NULL;
+	}
+	return monitor_socket;
+}
+
+/* A connection went away (or its fd was reused, so it must have): all the
+ * peers we last heard from on that connection are now considered gone */
+static void janus_zeromq_connection_gone(gboolean admin, int fd) {
+	GHashTable *peers = admin ? admin_peers : janus_peers;
+	gint64 now = g_get_monotonic_time();
+	GHashTableIter iter;
+	gpointer key = NULL;
+	g_hash_table_iter_init(&iter, peers);
+	while(g_hash_table_iter_next(&iter, &key, NULL)) {
+		janus_zeromq_client *client = (janus_zeromq_client *)key;
+		if(client->fd != fd || client->disconnected != 0)
+			continue;
+		JANUS_LOG(LOG_VERB, "ZeroMQ %speer disconnected (%d sessions)\n", admin ? "admin " : "",
+			g_atomic_int_get(&client->sessions));
+		client->fd = -1;
+		client->disconnected = now;
+		janus_zeromq_gone_timer *timer = g_malloc(sizeof(janus_zeromq_gone_timer));
+		timer->client = client;
+		janus_zeromq_client_ref(client);
+		timer->disconnected = now;
+		g_queue_push_tail(gone_timers, timer);
+	}
+}
+
+/* Reads the events of a socket monitor */
+static void janus_zeromq_monitor_read(gboolean admin) {
+	void *socket = admin ? zmq_admin_monitor : zmq_janus_monitor;
+	zmq_msg_t message;
+	while(TRUE) {
+		/* Each event is made of a frame with the event and value, and one with the endpoint */
+		zmq_msg_init(&message);
+		if(zmq_msg_recv(&message, socket, ZMQ_DONTWAIT) < 0) {
+			zmq_msg_close(&message);
+			break;
+		}
+		guint16 event = 0;
+		guint32 value = 0;
+		if(zmq_msg_size(&message) >= 6) {
+			const guint8 *data = zmq_msg_data(&message);
+			memcpy(&event, data, sizeof(event));
+			memcpy(&value, data + 2, sizeof(value));
+		}
+		while(zmq_msg_more(&message) && zmq_msg_recv(&message, socket, 0) >= 0);
+		zmq_msg_close(&message);
+		if(event == ZMQ_EVENT_DISCONNECTED || event == ZMQ_EVENT_ACCEPTED)
+			janus_zeromq_connection_gone(admin, (int)value);
+	}
+}
+
+/* Releases the peers that disconnected and didn't come back in time,
+ * and returns how long (in ms) until the next one should be, or -1 */
+static long janus_zeromq_gone_timers_check(void) {
+	if(gone_timers == NULL)
+		return -1;
+	gint64 now = g_get_monotonic_time();
+	janus_zeromq_gone_timer *timer = NULL;
+	while((timer = g_queue_peek_head(gone_timers)) != NULL) {
+		janus_zeromq_client *client = timer->client;
+		/* The peer may have come back in the meanwhile */
+		gboolean stale = (client->disconnected != timer->disconnected);
+		if(!stale && timer->disconnected + disconnect_grace > now)
+			return (long)((timer->disconnected + disconnect_grace - now + 999) / 1000);
+		if(!stale) {
+			JANUS_LOG(LOG_INFO, "ZeroMQ %speer gone, releasing it (%d sessions)\n", client->admin ? "admin " : "",
+				g_atomic_int_get(&client->sessions));
+			/* Let the core get rid of the sessions it created: the registry
+			 * is then cleaned up as usual, when they're over */
+			if(g_atomic_int_get(&client->sessions) > 0 && gateway->transport_gone != NULL)
+				gateway->transport_gone(&janus_zeromq_transport, &client->transport);
+			/* Peers are indexed by identity, make sure we don't remove a different one */
+			GHashTable *peers = client->admin ? admin_peers : janus_peers;
+			if(g_hash_table_lookup(peers, client) == client)
+				g_hash_table_remove(peers, client);
+		}
+		g_queue_pop_head(gone_timers);
+		janus_zeromq_client_unref(client);
+		g_free(timer);
+	}
+	return -1;
+}
+
+/* Session management */
+static void janus_zeromq_session_set_owner(janus_zeromq_session *session, janus_transport_session *transport) {
+	janus_zeromq_client *client = transport ? (janus_zeromq_client *)transport->transport_data : NULL;
+	if(client == session->client)
+		return;
+	if(session->client != NULL) {
+		g_atomic_int_add(&session->client->sessions, -1);
+		janus_zeromq_client_unref(session->client);
+	}
+	session->client = client;
+	if(client != NULL) {
+		janus_zeromq_client_ref(client);
+		g_atomic_int_inc(&client->sessions);
+	}
+}
+
+static void janus_zeromq_session_free(janus_zeromq_session *session) {
+	if(session == NULL)
+		return;
+	janus_zeromq_session_set_owner(session, NULL);
+	g_free(session);
+}
+
+/* Returns a reference to the peer owning a session, if any */
+static janus_zeromq_client *janus_zeromq_session_get_owner(guint64 session_id) {
+	if(session_id == 0)
+		return NULL;
+	janus_zeromq_client *client = NULL;
+	janus_zeromq_sessions_stripe *stripe = janus_zeromq_sessions_stripe_for(session_id);
+	janus_mutex_lock(&stripe->mutex);
+	janus_zeromq_session *session = g_hash_table_lookup(stripe->sessions, &session_id);
+	if(session != NULL && session->client != NULL) {
+		client = session->client;
+		janus_zeromq_client_ref(client);
+	}
+	janus_mutex_unlock(&stripe->mutex);
+	return client;
+}
+
+/* Helper to parse the socket type for an API out of the configuration */
+static int janus_zeromq_parse_mode(const char *value, const char *api) {
+	if(value == NULL || !strcasecmp(value, "rep"))
+		return ZMQ_REP;
+	if(!strcasecmp(value, "router"))
+		return ZMQ_ROUTER;
+	JANUS_LOG(LOG_WARN, "Unsupported mode '%s' for the %s API, falling back to 'rep'\n", value, api);
+	return ZMQ_REP;
+}
+
+/* Helpers to parse and name the codec of an API */
+static janus_zeromq_codec janus_zeromq_parse_codec(const char *value, const char *api) {
+	if(value == NULL || !strcasecmp(value, "json"))
+		return janus_zeromq_codec_json;
+	if(!strcasecmp(value, "msgpack"))
+		return janus_zeromq_codec_msgpack;
+	if(!strcasecmp(value, "auto"))
+		return janus_zeromq_codec_auto;
+	JANUS_LOG(LOG_WARN, "Unsupported codec '%s' for the %s API, falling back to 'json'\n", value, api);
+	return janus_zeromq_codec_json;
+}
+
+static const char *janus_zeromq_codec_str(janus_zeromq_codec codec) {
+	switch(codec) {
+		case janus_zeromq_codec_msgpack:
+			return "msgpack";
+		case janus_zeromq_codec_auto:
+			return "auto";
+		default:
+			break;
+	}
+	return "json";
+}
+
+/* Helper to parse a comma separated list of endpoints */
+static gchar **janus_zeromq_parse_endpoints(const char *value) {
+	if(value == NULL)
+		return NULL;
+	gchar **list = g_strsplit(value, ",", -1);
+	guint i = 0, num = 0;
+	for(i = 0; list[i] != NULL; i++) {
+		gchar *endpoint = g_strstrip(list[i]);
+		if(*endpoint == '\0') {
+			g_free(endpoint);
+			continue;
+		}
+		list[num++] = endpoint;
+	}
+	list[num] = NULL;
+	if(num == 0) {
+		g_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+/* Helper to create, configure and bind the socket for one of the APIs */
+static void *janus_zeromq_create_socket(int type, const char *bind_address, gchar **extra_addresses, gboolean admin) {
+	void *socket = zmq_socket(zmq_context, type);
+	if(socket == NULL) {
+		JANUS_LOG(LOG_FATAL, "Could not create ZeroMQ %ssocket: %s\n", admin ? "admin " : "", zmq_strerror(errno));
+		return NULL;
+	}
+
+	/* Set socket options */
+	int linger = 0;
+	zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+	if(recv_hwm > 0)
+		zmq_setsockopt(socket, ZMQ_RCVHWM, &recv_hwm, sizeof(recv_hwm));
+	if(send_hwm > 0)
+		zmq_setsockopt(socket, ZMQ_SNDHWM, &send_hwm, sizeof(send_hwm));
+
+	if(heartbeat_interval > 0) {
+		/* Send ZMTP heartbeats, and drop connections that don't answer */
+		zmq_setsockopt(socket, ZMQ_HEARTBEAT_IVL, &heartbeat_interval, sizeof(heartbeat_interval));
+		zmq_setsockopt(socket, ZMQ_HEARTBEAT_TIMEOUT, &heartbeat_timeout, sizeof(heartbeat_timeout));
+		zmq_setsockopt(socket, ZMQ_HEARTBEAT_TTL, &heartbeat_ttl, sizeof(heartbeat_ttl));
+	}
+
+	if(type == ZMQ_ROUTER) {
+		/* Fail loudly rather than silently dropping messages for peers that went away */
+		int mandatory = 1;
+		zmq_setsockopt(socket, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+	}
+
+	if(zmq_bind(socket, bind_address) < 0) {
+		JANUS_LOG(LOG_FATAL, "Could not bind ZeroMQ %ssocket to %s: %s\n", admin ? "admin " : "",
+			bind_address, zmq_strerror(errno));
+		zmq_close(socket);
+		return NULL;
+	}
+	/* The same socket can serve more endpoints, e.g., ipc:// for local peers */
+	int i = 0;
+	for(i = 0; extra_addresses != NULL && extra_addresses[i] != NULL; i++) {
+		if(zmq_bind(socket, extra_addresses[i]) < 0) {
+			JANUS_LOG(LOG_FATAL, "Could not bind ZeroMQ %ssocket to %s: %s\n", admin ? "admin " : "",
+				extra_addresses[i], zmq_strerror(errno));
+			zmq_close(socket);
+			return NULL;
+		}
+		JANUS_LOG(LOG_INFO, "ZeroMQ %ssocket also bound to %s\n", admin ? "admin " : "", extra_addresses[i]);
+	}
+	return socket;
+}
+
+/* Helper to receive a request: in ROUTER mode this also reads the envelope
+ * (routing identity and optional empty delimiter) preceding the payload,
+ * and fills in the envelope that will be needed to route replies back */
+static int janus_zeromq_recv(void *socket, int type, zmq_msg_t *message, janus_zeromq_envelope *envelope) {
+	envelope->identity_len = 0;
+	envelope->delimiter = FALSE;
+	int size = zmq_msg_recv(message, socket, ZMQ_DONTWAIT);
+	if(size < 0 || type != ZMQ_ROUTER)
+		return size;
+	/* First frame is the routing identity */
+	if(!zmq_msg_more(message) || size == 0 || size > (int)sizeof(envelope->identity)) {
+		JANUS_LOG(LOG_WARN, "Invalid ZeroMQ envelope, dropping message\n");
+		goto discard;
+	}
+	envelope->identity_len = size;
+	memcpy(envelope->identity, zmq_msg_data(message), size);
+	zmq_msg_close(message);
+	zmq_msg_init(message);
+	size = zmq_msg_recv(message, socket, 0);
+	if(size == 0 && zmq_msg_more(message)) {
+		/* Empty delimiter frame (REQ peers, or DEALER peers emulating them) */
+		envelope->delimiter = TRUE;
+		zmq_msg_close(message);
+		zmq_msg_init(message);
+		size = zmq_msg_recv(message, socket, 0);
+	}
+	if(size < 0)
+		return size;
+	if(!zmq_msg_more(message))
+		return size;
+	JANUS_LOG(LOG_WARN, "Unexpected multipart ZeroMQ message, dropping it\n");
+discard:
+	/* Drain whatever is left of this message */
+	while(zmq_msg_more(message)) {
+		zmq_msg_close(message);
+		zmq_msg_init(message);
+		if(zmq_msg_recv(message, socket, 0) < 0)
+			break;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Buffers management */
+static janus_zeromq_buffer *janus_zeromq_buffer_get(void) {
+	janus_zeromq_buffer *buffer = janus_zeromq_pool_get(buffers_pool);
+	if(buffer != NULL) {
+		buffer->len = 0;
+		return buffer;
+	}
+	/* Pool is empty, allocate a new buffer */
+	buffer = g_malloc(sizeof(janus_zeromq_buffer));
+	buffer->size = JANUS_ZEROMQ_BUFFER_INITIAL_SIZE;
+	buffer->data = g_malloc(buffer->size);
+	buffer->len = 0;
+	return buffer;
+}
+
+static void janus_zeromq_buffer_free(janus_zeromq_buffer *buffer) {
+	g_free(buffer->data);
+	g_free(buffer);
+}
+
+static void janus_zeromq_buffer_release(janus_zeromq_buffer *buffer) {
+	if(buffer == NULL)
+		return;
+	if(buffer->size <= JANUS_ZEROMQ_BUFFER_MAX_POOLED && janus_zeromq_pool_put(buffers_pool, buffer))
+		return;
+	/* Too large, or the pool is full */
+	janus_zeromq_buffer_free(buffer);
+}
+
+/* Called by ZeroMQ (possibly from one of its I/O threads) when done with a frame */
+static void janus_zeromq_buffer_free_cb(void *data, void *hint) {
+	janus_zeromq_buffer_release((janus_zeromq_buffer *)hint);
+}
+
+static void janus_zeromq_buffer_append(janus_zeromq_buffer *buffer, const char *data, size_t len) {
+	if(buffer->len + len > buffer->size) {
+		while(buffer->len + len > buffer->size)
+			buffer->size *= 2;
+		buffer->data = g_realloc(buffer->data, buffer->size);
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+}
+
+static int janus_zeromq_buffer_dump_cb(const char *data, size_t size, void *user_data) {
+	janus_zeromq_buffer_append((janus_zeromq_buffer *)user_data, data, size);
+	return 0;
+}
+
+/* MessagePack codec */
+static void janus_zeromq_msgpack_put(janus_zeromq_buffer *buffer, guint8 type, guint64 value, int bytes) {
+	guint8 data[9];
+	data[0] = type;
+	int i = 0;
+	for(i = 0; i < bytes; i++)
+		data[1+i] = (value >> (8*(bytes-1-i))) & 0xFF;
+	janus_zeromq_buffer_append(buffer, (const char *)data, 1 + bytes);
+}
+
+static void janus_zeromq_msgpack_put_length(janus_zeromq_buffer *buffer, size_t len,
+		guint8 fix, size_t fix_max, guint8 type8, guint8 type16, guint8 type32) {
+	if(len <= fix_max)
+		janus_zeromq_msgpack_put(buffer, fix | len, 0, 0);
+	else if(type8 && len <= 0xFF)
+		janus_zeromq_msgpack_put(buffer, type8, len, 1);
+	else if(len <= 0xFFFF)
+		janus_zeromq_msgpack_put(buffer, type16, len, 2);
+	else
+		janus_zeromq_msgpack_put(buffer, type32, len, 4);
+}
+
+static int janus_zeromq_msgpack_encode(janus_zeromq_buffer *buffer, json_t *value) {
+	switch(json_typeof(value)) {
+		case JSON_NULL:
+			janus_zeromq_msgpack_put(buffer, 0xc0, 0, 0);
+			break;
+		case JSON_FALSE:
+			janus_zeromq_msgpack_put(buffer, 0xc2, 0, 0);
+			break;
+		case JSON_TRUE:
+			janus_zeromq_msgpack_put(buffer, 0xc3, 0, 0);
+			break;
+		case JSON_INTEGER: {
+			json_int_t num = json_integer_value(value);
+			if(num >= 0) {
+				if(num < 128)
+					janus_zeromq_msgpack_put(buffer, (guint8)num, 0, 0);
+				else if(num <= 0xFF)
+					janus_zeromq_msgpack_put(buffer, 0xcc, num, 1);
+				else if(num <= 0xFFFF)
+					janus_zeromq_msgpack_put(buffer, 0xcd, num, 2);
+				else if(num <= 0xFFFFFFFFLL)
+					janus_zeromq_msgpack_put(buffer, 0xce, num, 4);
+				else
+					janus_zeromq_msgpack_put(buffer, 0xcf, num, 8);
+			} else {
+				if(num >= -32)
+					janus_zeromq_msgpack_put(buffer, (guint8)(gint8)num, 0, 0);
+				else if(num >= G_MININT8)
+					janus_zeromq_msgpack_put(buffer, 0xd0, (guint8)num, 1);
+				else if(num >= G_MININT16)
+					janus_zeromq_msgpack_put(buffer, 0xd1, (guint16)num, 2);
+				else if(num >= G_MININT32)
+					janus_zeromq_msgpack_put(buffer, 0xd2, (guint32)num, 4);
+				else
+					janus_zeromq_msgpack_put(buffer, 0xd3, (guint64)num, 8);
+			}
+			break;
+		}
+		case JSON_REAL: {
+			double num = json_real_value(value);
+			guint64 bits = 0;
+			memcpy(&bits, &num, sizeof(bits));
+			janus_zeromq_msgpack_put(buffer, 0xcb, bits, 8);
+			break;
+		}
+		case JSON_STRING: {
+			size_t len = json_string_length(value);
+			janus_zeromq_msgpack_put_length(buffer, len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+			janus_zeromq_buffer_append(buffer, json_string_value(value), len);
+			break;
+		}
+		case JSON_ARRAY: {
+			size_t i = 0, size = json_array_size(value);
+			janus_zeromq_msgpack_put_length(buffer, size, 0x90, 15, 0, 0xdc, 0xdd);
+			for(i = 0; i < size; i++) {
+				if(janus_zeromq_msgpack_encode(buffer, json_array_get(value, i)) < 0)
+					return -1;
+			}
+			break;
+		}
+		case JSON_OBJECT: {
+			const char *key = NULL;
+			json_t *item = NULL;
+			janus_zeromq_msgpack_put_length(buffer, json_object_size(value), 0x80, 15, 0, 0xde, 0xdf);
+			json_object_foreach(value, key, item) {
+				size_t len = strlen(key);
+				janus_zeromq_msgpack_put_length(buffer, len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+				janus_zeromq_buffer_append(buffer, key, len);
+				if(janus_zeromq_msgpack_encode(buffer, item) < 0)
+					return -1;
+			}
+			break;
+		}
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/* Reads a big endian unsigned integer of the specified size, if available */
+static gboolean janus_zeromq_msgpack_get(const guint8 **data, const guint8 *end, int bytes, guint64 *value) {
+	if(end - *data < bytes)
+		return FALSE;
+	*value = 0;
+	int i = 0;
+	for(i = 0; i < bytes; i++)
+		*value = (*value << 8) | (*data)[i];
+	*data += bytes;
+	return TRUE;
+}
+
+static json_t *janus_zeromq_msgpack_decode(const guint8 **data, const guint8 *end, int depth) {
+	if(*data >= end || depth > JANUS_ZEROMQ_MSGPACK_MAX_DEPTH)
+		return NULL;
+	guint8 type = *(*data)++;
+	guint64 len = 0, num = 0;
+	/* Fixed size types first */
+	if(type <= 0x7f)
+		return json_integer(type);
+	if(type >= 0xe0)
+		return json_integer((gint8)type);
+	if(type == 0xc0)
+		return json_null();
+	if(type == 0xc2)
+		return json_false();
+	if(type == 0xc3)
+		return json_true();
+	if(type >= 0xcc && type <= 0xcf) {
+		if(!janus_zeromq_msgpack_get(data, end, 1 << (type - 0xcc), &num) || num > G_MAXINT64)
+			return NULL;
+		return json_integer((json_int_t)num);
+	}
+	if(type >= 0xd0 && type <= 0xd3) {
+		int bytes = 1 << (type - 0xd0);
+		if(!janus_zeromq_msgpack_get(data, end, bytes, &num))
+			return NULL;
+		/* Sign extension */
+		if(bytes < 8 && (num & (1ULL << (8*bytes - 1))))
+			num |= ~((1ULL << (8*bytes)) - 1);
+		return json_integer((json_int_t)(gint64)num);
+	}
+	if(type == 0xca || type == 0xcb) {
+		if(!janus_zeromq_msgpack_get(data, end, type == 0xca ? 4 : 8, &num))
+			return NULL;
+		if(type == 0xca) {
+			guint32 bits = (guint32)num;
+			float f = 0;
+			memcpy(&f, &bits, sizeof(f));
+			return json_real(f);
+		}
+		double d = 0;
+		memcpy(&d, &num, sizeof(d));
+		return json_real(d);
+	}
+	/* Strings (and binary data, which we treat the same way) */
+	if((type & 0xe0) == 0xa0 || (type >= 0xd9 && type <= 0xdb) || (type >= 0xc4 && type <= 0xc6)) {
+		if((type & 0xe0) == 0xa0)
+			len = type & 0x1f;
+		else if(!janus_zeromq_msgpack_get(data, end, 1 << (type >= 0xd9 ? type - 0xd9 : type - 0xc4), &len))
+			return NULL;
+		if((guint64)(end - *data) < len)
+			return NULL;
+		json_t *string = json_stringn((const char *)*data, len);
+		*data += len;
+		return string;
+	}
+	/* Containers */
+	if((type & 0xf0) == 0x90 || type == 0xdc || type == 0xdd) {
+		if((type & 0xf0) == 0x90)
+			len = type & 0x0f;
+		else if(!janus_zeromq_msgpack_get(data, end, type == 0xdc ? 2 : 4, &len))
+			return NULL;
+		/* Each item takes at least a byte */
+		if((guint64)(end - *data) < len)
+			return NULL;
+		json_t *array = json_array();
+		guint64 i = 0;
+		for(i = 0; i < len; i++) {
+			json_t *item = janus_zeromq_msgpack_decode(data, end, depth + 1);
+			if(item == NULL) {
+				json_decref(array);
+				return NULL;
+			}
+			json_array_append_new(array, item);
+		}
+		return array;
+	}
+	if((type & 0xf0) == 0x80 || type == 0xde || type == 0xdf) {
+		if((type & 0xf0) == 0x80)
+			len = type & 0x0f;
+		else if(!janus_zeromq_msgpack_get(data, end, type == 0xde ? 2 : 4, &len))
+			return NULL;
+		if((guint64)(end - *data) < 2*len)
+			return NULL;
+		json_t *object = json_object();
+		guint64 i = 0;
+		for(i = 0; i < len; i++) {
+			json_t *key = janus_zeromq_msgpack_decode(data, end, depth + 1);
+			json_t *item = key ? janus_zeromq_msgpack_decode(data, end, depth + 1) : NULL;
+			/* Keys must be strings, with no NUL in them */
+			if(item == NULL || !json_is_string(key) || strlen(json_string_value(key)) != json_string_length(key)) {
+				json_decref(key);
+				json_decref(item);
+				json_decref(object);
+				return NULL;
+			}
+			json_object_set_new(object, json_string_value(key), item);
+			json_decref(key);
+		}
+		return object;
+	}
+	/* Extension types are not supported */
+	return NULL;
+}
+
+/* Helper to tell whether a request was encoded with MessagePack */
+static gboolean janus_zeromq_is_msgpack(const guint8 *data, size_t len) {
+	if(len == 0)
+		return FALSE;
+	guint8 type = data[0];
+	return (type & 0xe0) == 0x80 || type == 0xdc || type == 0xdd || type == 0xde || type == 0xdf;
+}
+
+/* Helpers to decode a request, or encode a reply, with the codec of a peer */
+static json_t *janus_zeromq_decode(janus_zeromq_codec codec, const char *payload, size_t len, json_error_t *error) {
+	if(codec != janus_zeromq_codec_msgpack)
+		return json_loadb(payload, len, 0, error);
+	const guint8 *data = (const guint8 *)payload, *end = data + len;
+	json_t *root = janus_zeromq_msgpack_decode(&data, end, 0);
+	if(root != NULL && data != end) {
+		json_decref(root);
+		root = NULL;
+	}
+	if(root == NULL && error != NULL)
+		g_snprintf(error->text, sizeof(error->text), "Invalid MessagePack");
+	return root;
+}
+
+static int janus_zeromq_encode(janus_zeromq_codec codec, json_t *message, janus_zeromq_buffer *buffer) {
+	if(codec == janus_zeromq_codec_msgpack)
+		return janus_zeromq_msgpack_encode(buffer, message);
+	return json_dump_callback(message, janus_zeromq_buffer_dump_cb, buffer, JSON_COMPACT);
+}
+
+/* Statistics */
+static janus_zeromq_stats *janus_zeromq_stats_get(void) {
+	janus_zeromq_stats *stats = g_private_get(&stats_key);
+	if(stats != NULL)
+		return stats;
+	/* First time this thread needs counters: add them to the list */
+	stats = g_malloc0(sizeof(janus_zeromq_stats));
+	janus_mutex_lock(&stats_mutex);
+	stats_list = g_list_prepend(stats_list, stats);
+	janus_mutex_unlock(&stats_mutex);
+	g_private_set(&stats_key, stats);
+	return stats;
+}
+
+static guint janus_zeromq_stats_verb(json_t *request) {
+	const char *verb = json_string_value(json_object_get(request, "janus"));
+	guint i = 0;
+	for(i = 0; verb != NULL && i < JANUS_ZEROMQ_STATS_VERBS - 1; i++) {
+		if(!strcmp(verb, stats_verbs[i]))
+			return i;
+	}
+	return JANUS_ZEROMQ_STATS_VERBS - 1;
+}
+
+static void janus_zeromq_histogram_add(janus_zeromq_histogram *histogram, gint64 value) {
+	guint64 v = value > 0 ? value : 0;
+	guint index = v;
+	if(v >= 8) {
+		int exp = 63 - __builtin_clzll(v);
+		if(exp > JANUS_ZEROMQ_HISTOGRAM_MAX_EXP)
+			index = JANUS_ZEROMQ_HISTOGRAM_BUCKETS - 1;
+		else
+			index = (exp - 2) * 8 + ((v >> (exp - 3)) & 0x07);
+	}
+	histogram->buckets[index]++;
+	histogram->count++;
+	histogram->sum += v;
+	if(v > histogram->max)
+		histogram->max = v;
+}
+
+/* Highest value that ends up in a bucket */
+static guint64 janus_zeromq_histogram_bucket_max(guint index) {
+	if(index < 8)
+		return index;
+	guint exp = index / 8 + 2, sub = index % 8;
+	return ((guint64)(8 + sub + 1) << (exp - 3)) - 1;
+}
+
+static json_t *janus_zeromq_histogram_summary(janus_zeromq_histogram *histogram) {
+	json_t *summary = json_object();
+	json_object_set_new(summary, "count", json_integer(histogram->count));
+	if(histogram->count == 0)
+		return summary;
+	json_object_set_new(summary, "avg", json_integer(histogram->sum / histogram->count));
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const char *names[] = { "p50", "p90", "p99", "p999" };
+	guint i = 0, p = 0;
+	guint64 seen = 0;
+	for(i = 0; i < JANUS_ZEROMQ_HISTOGRAM_BUCKETS && p < G_N_ELEMENTS(percentiles); i++) {
+		seen += histogram->buckets[i];
+		while(p < G_N_ELEMENTS(percentiles) && seen >= (guint64)(percentiles[p] * histogram->count + 0.5) && seen > 0) {
+			json_object_set_new(summary, names[p], json_integer(MIN(janus_zeromq_histogram_bucket_max(i), histogram->max)));
+			p++;
+		}
+	}
+	json_object_set_new(summary, "max", json_integer(histogram->max));
+	return summary;
+}
+
+static void janus_zeromq_histogram_merge(janus_zeromq_histogram *dst, janus_zeromq_histogram *src) {
+	guint i = 0;
+	for(i = 0; i < JANUS_ZEROMQ_HISTOGRAM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+static void janus_zeromq_stats_merge(janus_zeromq_stats *dst, janus_zeromq_stats *src) {
+	guint api = 0, verb = 0;
+	for(api = 0; api < 2; api++) {
+		dst->api[api].bytes_in += src->api[api].bytes_in;
+		dst->api[api].bytes_out += src->api[api].bytes_out;
+		dst->api[api].parse_failures += src->api[api].parse_failures;
+		for(verb = 0; verb < JANUS_ZEROMQ_STATS_VERBS; verb++) {
+			dst->api[api].verbs[verb].received += src->api[api].verbs[verb].received;
+			janus_zeromq_histogram_merge(&dst->api[api].verbs[verb].queue, &src->api[api].verbs[verb].queue);
+			janus_zeromq_histogram_merge(&dst->api[api].verbs[verb].reply, &src->api[api].verbs[verb].reply);
+		}
+	}
+}
+
+/* Called when a thread that has counters exits: we add them to those of the
+ * threads that exited before, rather than keeping a set for each thread that
+ * ever sent or received something (e.g., the ones of the core thread pools) */
+static void janus_zeromq_stats_retire(gpointer data) {
+	janus_zeromq_stats *stats = (janus_zeromq_stats *)data;
+	janus_mutex_lock(&stats_mutex);
+	stats_list = g_list_remove(stats_list, stats);
+	if(stats_retired == NULL)
+		stats_retired = g_malloc0(sizeof(janus_zeromq_stats));
+	janus_zeromq_stats_merge(stats_retired, stats);
+	janus_mutex_unlock(&stats_mutex);
+	g_free(stats);
+}
+
+/* Sums the counters of all threads (which may be a bit behind) */
+static json_t *janus_zeromq_stats_summary(void) {
+	janus_zeromq_stats *total = g_malloc0(sizeof(janus_zeromq_stats));
+	janus_mutex_lock(&stats_mutex);
+	if(stats_retired != NULL)
+		janus_zeromq_stats_merge(total, stats_retired);
+	GList *l = NULL;
+	for(l = stats_list; l != NULL; l = l->next)
+		janus_zeromq_stats_merge(total, (janus_zeromq_stats *)l->data);
+	janus_mutex_unlock(&stats_mutex);
+	json_t *summary = json_object();
+	guint api = 0, verb = 0;
+	for(api = 0; api < 2; api++) {
+		json_t *info = json_object();
+		json_object_set_new(info, "bytes_in", json_integer(total->api[api].bytes_in));
+		json_object_set_new(info, "bytes_out", json_integer(total->api[api].bytes_out));
+		json_object_set_new(info, "parse_failures", json_integer(total->api[api].parse_failures));
+		json_t *verbs = json_object();
+		for(verb = 0; verb < JANUS_ZEROMQ_STATS_VERBS; verb++) {
+			if(total->api[api].verbs[verb].received == 0)
+				continue;
+			json_t *v = json_object();
+			json_object_set_new(v, "received", json_integer(total->api[api].verbs[verb].received));
+			json_object_set_new(v, "queue_us", janus_zeromq_histogram_summary(&total->api[api].verbs[verb].queue));
+			json_object_set_new(v, "reply_us", janus_zeromq_histogram_summary(&total->api[api].verbs[verb].reply));
+			json_object_set_new(verbs, stats_verbs[verb], v);
+		}
+		json_object_set_new(info, "requests", verbs);
+		json_object_set_new(summary, api ? "admin_api" : "janus_api", info);
+	}
+	g_free(total);
+	return summary;
+}
+
+/* Helper to send a buffer on one of the API sockets: in ROUTER mode the
+ * envelope of the target client is prepended to the payload. The buffer
+ * is handed to ZeroMQ as it is, and recycled when it's done with it.
+ * This never blocks: if the peer reached its high water mark, the message
+ * is dropped and we fail with EAGAIN. This must only be called by the
+ * thread that owns the socket */
+static int janus_zeromq_send(gboolean admin, janus_zeromq_client *client, janus_zeromq_buffer *buffer) {
+	void *socket = admin ? zmq_admin_socket : zmq_janus_socket;
+	int type = admin ? admin_socket_type : janus_socket_type;
+	int ret = 0;
+	if(type == ZMQ_ROUTER) {
+		if(client == NULL || client->envelope.identity_len == 0) {
+			JANUS_LOG(LOG_ERR, "Can't route ZeroMQ message, missing peer identity\n");
+			janus_zeromq_buffer_release(buffer);
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+		/* The first frame is the only one that can fail: once it's queued, so is the rest */
+		ret = zmq_send(socket, client->envelope.identity, client->envelope.identity_len, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+		if(ret >= 0 && client->envelope.delimiter)
+			ret = zmq_send(socket, NULL, 0, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+		if(ret < 0) {
+			int error = errno;
+			if(error == EAGAIN) {
+				g_atomic_int_inc(&messages_dropped);
+				JANUS_LOG(LOG_WARN, "ZeroMQ %speer not reading its messages, dropping one\n", admin ? "admin " : "");
+			}
+			janus_zeromq_buffer_release(buffer);
+			errno = error;
+			return ret;
+		}
+	}
+	zmq_msg_t message;
+	zmq_msg_init_data(&message, buffer->data, buffer->len, janus_zeromq_buffer_free_cb, buffer);
+	ret = zmq_msg_send(&message, socket, ZMQ_DONTWAIT);
+	if(ret < 0) {
+		int error = errno;
+		if(error == EAGAIN) {
+			g_atomic_int_inc(&messages_dropped);
+			JANUS_LOG(LOG_WARN, "ZeroMQ %speer not reading its messages, dropping one\n", admin ? "admin " : "");
+		}
+		/* This invokes the free callback */
+		zmq_msg_close(&message);
+		errno = error;
+	} else {
+		janus_zeromq_stats_get()->api[admin].bytes_out += ret;
+	}
+	return ret;
+}
+
+/* Helper to publish an event for a session on the PUB socket: only called
+ * by the thread that owns the sockets, and takes ownership of the buffer */
+static int janus_zeromq_publish(guint64 session_id, janus_zeromq_buffer *buffer) {
+	char topic[32];
+	int topic_len = g_snprintf(topic, sizeof(topic), "%"SCNu64"/", session_id);
+	int ret = zmq_send(zmq_publish_socket, topic, topic_len, ZMQ_SNDMORE);
+	if(ret < 0) {
+		janus_zeromq_buffer_release(buffer);
+		return ret;
+	}
+	zmq_msg_t message;
+	zmq_msg_init_data(&message, buffer->data, buffer->len, janus_zeromq_buffer_free_cb, buffer);
+	ret = zmq_msg_send(&message, zmq_publish_socket, 0);
+	if(ret < 0) {
+		int error = errno;
+		zmq_msg_close(&message);
+		errno = error;
+	} else {
+		g_atomic_int_inc(&events_published);
+		janus_zeromq_stats_get()->api[0].bytes_out += ret;
+	}
+	return ret;
+}
+
+/* Chunked replies management */
+static janus_zeromq_stream *janus_zeromq_stream_new(void) {
+	janus_zeromq_stream *stream = g_malloc0(sizeof(janus_zeromq_stream));
+	stream->id = (guint)g_atomic_int_add(&chunked_replies, 1) + 1;
+	janus_mutex_init(&stream->mutex);
+	janus_condition_init(&stream->cond);
+	stream->ref = 1;
+	return stream;
+}
+
+static void janus_zeromq_stream_unref(janus_zeromq_stream *stream) {
+	if(stream == NULL || !g_atomic_int_dec_and_test(&stream->ref))
+		return;
+	janus_mutex_clear(&stream->mutex);
+	janus_condition_clear(&stream->cond);
+	g_free(stream);
+}
+
+/* Called when we're done with a chunk, whether it was sent or not: this
+ * wakes up the thread serializing the reply, and releases the reference */
+static gboolean janus_zeromq_stream_failed(janus_zeromq_stream *stream) {
+	janus_mutex_lock(&stream->mutex);
+	gboolean failed = stream->failed;
+	janus_mutex_unlock(&stream->mutex);
+	return failed;
+}
+
+static void janus_zeromq_stream_abort(janus_zeromq_stream *stream) {
+	janus_mutex_lock(&stream->mutex);
+	stream->failed = TRUE;
+	janus_condition_signal(&stream->cond);
+	janus_mutex_unlock(&stream->mutex);
+}
+
+static void janus_zeromq_stream_done(janus_zeromq_stream *stream, gboolean sent) {
+	janus_mutex_lock(&stream->mutex);
+	stream->queued--;
+	if(!sent)
+		stream->failed = TRUE;
+	janus_condition_signal(&stream->cond);
+	janus_mutex_unlock(&stream->mutex);
+	janus_zeromq_stream_unref(stream);
+}
+
+/* Helper to send a chunk of a reply: unlike janus_zeromq_send, this doesn't
+ * drop the chunk when the peer isn't draining its queue, but fails with
+ * EAGAIN, in which case the buffer still belongs to the caller, who can
+ * try again */
+static int janus_zeromq_send_chunk(janus_zeromq_outgoing *msg) {
+	void *socket = msg->admin ? zmq_admin_socket : zmq_janus_socket;
+	janus_zeromq_client *client = msg->client;
+	if(client == NULL || client->envelope.identity_len == 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	/* The first frame is the only one that can fail: once it's queued, so is the rest */
+	int ret = zmq_send(socket, client->envelope.identity, client->envelope.identity_len, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+	if(ret < 0)
+		return ret;
+	if(client->envelope.delimiter)
+		zmq_send(socket, NULL, 0, ZMQ_SNDMORE);
+	char header[64];
+	int header_len = g_snprintf(header, sizeof(header), "chunk %u %u %s",
+		msg->stream->id, msg->chunk, msg->last ? "last" : "more");
+	zmq_send(socket, header, header_len, ZMQ_SNDMORE);
+	janus_zeromq_buffer *buffer = msg->buffer;
+	msg->buffer = NULL;
+	zmq_msg_t message;
+	zmq_msg_init_data(&message, buffer->data, buffer->len, janus_zeromq_buffer_free_cb, buffer);
+	ret = zmq_msg_send(&message, socket, 0);
+	if(ret < 0) {
+		int error = errno;
+		zmq_msg_close(&message);
+		errno = error;
+		return ret;
+	}
+	janus_zeromq_stats_get()->api[msg->admin].bytes_out += ret + header_len;
+	return ret;
+}
+
+/* Helper to tell a peer that a chunked reply was aborted, starting from the
+ * chunk in msg (the first one it won't get): this is only done once per
+ * reply, and dropped like any other message if the peer can't take it */
+static void janus_zeromq_send_chunk_abort(janus_zeromq_outgoing *msg) {
+	void *socket = msg->admin ? zmq_admin_socket : zmq_janus_socket;
+	janus_zeromq_stream *stream = msg->stream;
+	janus_zeromq_client *client = msg->client;
+	if(stream->aborted || client == NULL || client->envelope.identity_len == 0)
+		return;
+	stream->aborted = TRUE;
+	if(zmq_send(socket, client->envelope.identity, client->envelope.identity_len, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0) {
+		if(errno == EAGAIN)
+			g_atomic_int_inc(&messages_dropped);
+		JANUS_LOG(LOG_WARN, "Couldn't tell ZeroMQ %speer chunked reply %u was aborted: %s\n",
+			msg->admin ? "admin " : "", stream->id, zmq_strerror(errno));
+		return;
+	}
+	if(client->envelope.delimiter)
+		zmq_send(socket, NULL, 0, ZMQ_SNDMORE);
+	char header[64];
+	int header_len = g_snprintf(header, sizeof(header), "chunk %u %u abort", stream->id, msg->chunk);
+	zmq_send(socket, header, header_len, ZMQ_SNDMORE);
+	zmq_send(socket, NULL, 0, 0);
+}
+
+/* Mailbox management */
+static int janus_zeromq_mailbox_init(janus_zeromq_mailbox *mailbox) {
+	mailbox->head = NULL;
+	mailbox->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(mailbox->fd < 0) {
+		JANUS_LOG(LOG_FATAL, "Could not create mailbox eventfd: %s\n", g_strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void janus_zeromq_outgoing_free(janus_zeromq_outgoing *msg) {
+	if(msg == NULL)
+		return;
+	/* A chunk that's freed without having been sent aborts its reply */
+	if(msg->stream != NULL)
+		janus_zeromq_stream_done(msg->stream, FALSE);
+	janus_zeromq_buffer_release(msg->buffer);
+	janus_zeromq_client_unref(msg->client);
+	g_free(msg->transaction);
+	g_free(msg);
+}
+
+static void janus_zeromq_mailbox_wakeup(janus_zeromq_mailbox *mailbox) {
+	uint64_t one = 1;
+	if(write(mailbox->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_WARN, "Error waking up the ZeroMQ thread: %s\n", g_strerror(errno));
+}
+
+static void janus_zeromq_mailbox_push(janus_zeromq_mailbox *mailbox, janus_zeromq_outgoing *msg) {
+	janus_zeromq_outgoing *head = NULL;
+	do {
+		head = g_atomic_pointer_get(&mailbox->head);
+		msg->next = head;
+	} while(!g_atomic_pointer_compare_and_exchange(&mailbox->head, head, msg));
+	if(head == NULL) {
+		/* The mailbox was empty, the owner may be sleeping: wake it up */
+		janus_zeromq_mailbox_wakeup(mailbox);
+	}
+}
+
+/* Detaches all the queued messages, returning them in the order they were pushed */
+static janus_zeromq_outgoing *janus_zeromq_mailbox_take(janus_zeromq_mailbox *mailbox) {
+	uint64_t count = 0;
+	if(read(mailbox->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_WARN, "Error reading from the mailbox eventfd: %s\n", g_strerror(errno));
+	janus_zeromq_outgoing *list = NULL;
+	do {
+		list = g_atomic_pointer_get(&mailbox->head);
+	} while(list != NULL && !g_atomic_pointer_compare_and_exchange(&mailbox->head, list, NULL));
+	/* Reverse the list, as producers push to the head */
+	janus_zeromq_outgoing *ordered = NULL;
+	while(list != NULL) {
+		janus_zeromq_outgoing *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	return ordered;
+}
+
+static void janus_zeromq_mailbox_destroy(janus_zeromq_mailbox *mailbox) {
+	janus_zeromq_outgoing *msg = janus_zeromq_mailbox_take(mailbox);
+	while(msg != NULL) {
+		janus_zeromq_outgoing *next = msg->next;
+		janus_zeromq_outgoing_free(msg);
+		msg = next;
+	}
+	close(mailbox->fd);
+	mailbox->fd = -1;
+}
+
+/* Called when we're done with a chunk that wasn't parked: only called by the
+ * thread that owns the sockets, and takes ownership of the message */
+static void janus_zeromq_chunk_done(janus_zeromq_outgoing *msg, int ret) {
+	if(ret < 0) {
+		/* Freeing the chunk will abort the reply */
+		JANUS_LOG(LOG_ERR, "Error sending ZeroMQ %sreply chunk: %s\n", msg->admin ? "admin " : "", zmq_strerror(errno));
+	} else {
+		janus_zeromq_stream *stream = msg->stream;
+		msg->stream = NULL;
+		janus_zeromq_stream_done(stream, TRUE);
+	}
+	janus_zeromq_outgoing_free(msg);
+}
+
+/* Sends a chunk, or parks it if the peer can't take it yet (or if previous
+ * chunks of the same reply are parked already): only called by the thread
+ * that owns the sockets, and takes ownership of the message */
+static void janus_zeromq_deliver_chunk(janus_zeromq_outgoing *msg) {
+	janus_zeromq_stream *stream = msg->stream;
+	if(janus_zeromq_stream_failed(stream)) {
+		/* The reply was aborted, don't send the rest of it: if previous chunks
+		 * are parked, the peer is told when they're dropped, and from there */
+		if(stream->blocked == 0)
+			janus_zeromq_send_chunk_abort(msg);
+		janus_zeromq_outgoing_free(msg);
+		return;
+	}
+	if(stream->blocked == 0) {
+		int ret = janus_zeromq_send_chunk(msg);
+		if(ret >= 0 || errno != EAGAIN) {
+			janus_zeromq_chunk_done(msg, ret);
+			return;
+		}
+		stream->blocked_since = g_get_monotonic_time();
+	}
+	stream->blocked++;
+	g_queue_push_tail(chunks_blocked, msg);
+}
+
+/* Tries sending the chunks that were parked, returning how long (in
+ * milliseconds) until we should try again, or -1 if there are none left */
+static long janus_zeromq_chunks_retry(void) {
+	if(chunks_blocked == NULL || g_queue_is_empty(chunks_blocked))
+		return -1;
+	chunks_blocked_pass++;
+	gint64 now = g_get_monotonic_time();
+	GList *l = chunks_blocked->head;
+	while(l != NULL) {
+		GList *next = l->next;
+		janus_zeromq_outgoing *msg = (janus_zeromq_outgoing *)l->data;
+		janus_zeromq_stream *stream = msg->stream;
+		if(janus_zeromq_stream_failed(stream)) {
+			/* The reply was aborted (e.g., the peer didn't drain it in time) */
+			janus_zeromq_send_chunk_abort(msg);
+			g_queue_delete_link(chunks_blocked, l);
+			stream->blocked--;
+			janus_zeromq_outgoing_free(msg);
+		} else if(stream->blocked_pass != chunks_blocked_pass) {
+			/* Chunks of the same reply must go out in order, so once one of them
+			 * is still blocked, we don't try the others until the next pass */
+			int ret = janus_zeromq_send_chunk(msg);
+			if(ret < 0 && errno == EAGAIN && now - stream->blocked_since >= chunk_timeout) {
+				/* The peer took nothing for too long, give up on the reply */
+				JANUS_LOG(LOG_WARN, "ZeroMQ peer not draining chunked reply %u, aborting it\n", stream->id);
+				janus_zeromq_stream_abort(stream);
+				janus_zeromq_send_chunk_abort(msg);
+				g_queue_delete_link(chunks_blocked, l);
+				stream->blocked--;
+				janus_zeromq_outgoing_free(msg);
+			} else if(ret < 0 && errno == EAGAIN) {
+				stream->blocked_pass = chunks_blocked_pass;
+			} else {
+				stream->blocked_since = now;
+				g_queue_delete_link(chunks_blocked, l);
+				stream->blocked--;
+				janus_zeromq_chunk_done(msg, ret);
+			}
+		}
+		l = next;
+	}
+	return g_queue_is_empty(chunks_blocked) ? -1 : JANUS_ZEROMQ_CHUNKS_RETRY_INTERVAL;
+}
+
+/* Sends the batch of replies that was being coalesced for a peer, if any */
+static void janus_zeromq_batch_send(janus_zeromq_client *client) {
+	janus_zeromq_buffer *batch = client->batch;
+	if(batch == NULL)
+		return;
+	if(g_atomic_int_get(&client->codec) == janus_zeromq_codec_msgpack) {
+		/* Fill in the size of the array32 we reserved room for */
+		guint i = 0;
+		for(i = 0; i < 4; i++)
+			batch->data[1+i] = (client->batch_count >> (8*(3-i))) & 0xFF;
+	} else {
+		janus_zeromq_buffer_append(batch, "]", 1);
+		JANUS_LOG(LOG_HUGE, "Sending ZeroMQ %sbatch: %.*s\n", client->admin ? "admin " : "", (int)batch->len, batch->data);
+	}
+	client->batch = NULL;
+	client->batch_count = 0;
+	if(janus_zeromq_send(client->admin, client, batch) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_ERR, "Error sending ZeroMQ %sbatch: %s\n", client->admin ? "admin " : "", zmq_strerror(errno));
+}
+
+/* Adds a reply to the batch of a peer, sending it if it's full: the buffer is
+ * copied to the batch, and then released */
+static void janus_zeromq_batch_append(janus_zeromq_client *client, janus_zeromq_buffer *buffer) {
+	if(client->batch == NULL) {
+		/* Start a new batch, and arm its timer */
+		client->batch = janus_zeromq_buffer_get();
+		if(g_atomic_int_get(&client->codec) == janus_zeromq_codec_msgpack) {
+			/* We'll know the size of the array only when sending it */
+			janus_zeromq_msgpack_put(client->batch, 0xdd, 0, 4);
+		} else {
+			janus_zeromq_buffer_append(client->batch, "[", 1);
+		}
+		client->batch_deadline = g_get_monotonic_time() + batch_window;
+		janus_zeromq_batch_timer *timer = g_malloc(sizeof(janus_zeromq_batch_timer));
+		timer->client = client;
+		janus_zeromq_client_ref(client);
+		timer->deadline = client->batch_deadline;
+		g_queue_push_tail(batch_timers, timer);
+	} else if(g_atomic_int_get(&client->codec) != janus_zeromq_codec_msgpack) {
+		janus_zeromq_buffer_append(client->batch, ",", 1);
+	}
+	janus_zeromq_buffer_append(client->batch, buffer->data, buffer->len);
+	janus_zeromq_buffer_release(buffer);
+	client->batch_count++;
+	if(client->batch_count >= batch_size)
+		janus_zeromq_batch_send(client);
+}
+
+/* Sends all the batches whose window expired, returning how long (in
+ * milliseconds) until the next one does, or -1 if there are none */
+static long janus_zeromq_batch_timers_check(void) {
+	if(batch_timers == NULL)
+		return -1;
+	gint64 now = g_get_monotonic_time();
+	janus_zeromq_batch_timer *timer = NULL;
+	while((timer = g_queue_peek_head(batch_timers)) != NULL) {
+		janus_zeromq_client *client = timer->client;
+		/* The batch may have been sent already because it was full */
+		gboolean stale = (client->batch == NULL || client->batch_deadline != timer->deadline);
+		if(!stale && timer->deadline > now)
+			return (long)((timer->deadline - now + 999) / 1000);
+		if(!stale)
+			janus_zeromq_batch_send(client);
+		g_queue_pop_head(batch_timers);
+		janus_zeromq_client_unref(client);
+		g_free(timer);
+	}
+	return -1;
+}
+
+/* Helper to send a message to a peer, or add it to its batch: only called
+ * by the thread that owns the sockets, and takes ownership of the buffer */
+static void janus_zeromq_deliver(gboolean admin, janus_zeromq_client *client, janus_zeromq_buffer *buffer, gboolean batched) {
+	if(client != NULL && batched)
+		janus_zeromq_batch_append(client, buffer);
+	else if(janus_zeromq_send(admin, client, buffer) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_ERR, "Error sending ZeroMQ %smessage: %s\n", admin ? "admin " : "", zmq_strerror(errno));
+}
+
+/* Idempotency cache */
+static void janus_zeromq_idempotency_entry_free(janus_zeromq_idempotency_entry *entry) {
+	if(entry == NULL)
+		return;
+	janus_zeromq_buffer_release(entry->reply);
+	g_bytes_unref(entry->key);
+	g_free(entry);
+}
+
+static GBytes *janus_zeromq_idempotency_key(gboolean admin, janus_zeromq_client *client, const char *transaction, size_t len) {
+	size_t identity_len = client ? client->envelope.identity_len : 0;
+	guint8 *key = g_malloc(2 + identity_len + len);
+	key[0] = admin ? 1 : 0;
+	key[1] = identity_len;
+	if(identity_len > 0)
+		memcpy(key + 2, client->envelope.identity, identity_len);
+	memcpy(key + 2 + identity_len, transaction, len);
+	return g_bytes_new_take(key, 2 + identity_len + len);
+}
+
+/* Gets rid of the entries that expired, and of the oldest ones if we're over the limit */
+static void janus_zeromq_idempotency_expire(void) {
+	if(idempotency_queue == NULL)
+		return;
+	gint64 now = g_get_monotonic_time();
+	janus_zeromq_idempotency_entry *entry = NULL;
+	while((entry = g_queue_peek_head(idempotency_queue)) != NULL) {
+		if(g_queue_get_length(idempotency_queue) <= idempotency_size && now < entry->expires)
+			break;
+		g_queue_pop_head(idempotency_queue);
+		g_hash_table_remove(idempotency_cache, entry->key);
+	}
+}
+
+/* Keeps a copy of a reply, in case the request it's for is retried */
+static void janus_zeromq_idempotency_store(gboolean admin, janus_zeromq_client *client, const char *transaction, janus_zeromq_buffer *buffer) {
+	if(idempotency_cache == NULL)
+		return;
+	GBytes *key = janus_zeromq_idempotency_key(admin, client, transaction, strlen(transaction));
+	janus_zeromq_idempotency_entry *entry = g_hash_table_lookup(idempotency_cache, key);
+	g_bytes_unref(key);
+	if(entry == NULL) {
+		/* Not a request we're tracking (e.g., an event, or an entry that expired) */
+		return;
+	}
+	/* Asynchronous requests get more than one reply (e.g., ack and event), keep the last */
+	if(entry->reply == NULL)
+		entry->reply = janus_zeromq_buffer_get();
+	entry->reply->len = 0;
+	janus_zeromq_buffer_append(entry->reply, buffer->data, buffer->len);
+}
+
+/* Sends all the messages that were queued in the mailbox: only called by
+ * the thread that owns the sockets */
+static void janus_zeromq_mailbox_flush(void) {
+	janus_zeromq_outgoing *msg = janus_zeromq_mailbox_take(&mailbox);
+	while(msg != NULL) {
+		janus_zeromq_outgoing *next = msg->next;
+		if(msg->request.received > 0) {
+			/* Replies are timed here rather than when the core gives them to us,
+			 * so that we never keep counters on the threads of the core */
+			janus_zeromq_histogram_add(&janus_zeromq_stats_get()->api[msg->admin].verbs[msg->request.verb].reply,
+				g_get_monotonic_time() - msg->request.received);
+		}
+		if(msg->stream != NULL) {
+			/* Chunks of large replies are never cached nor batched */
+			msg->next = NULL;
+			janus_zeromq_deliver_chunk(msg);
+			msg = next;
+			continue;
+		}
+		if(msg->client == NULL || g_atomic_int_get(&msg->client->codec) == janus_zeromq_codec_json)
+			JANUS_LOG(LOG_HUGE, "Sending ZeroMQ %smessage: %.*s\n", msg->admin ? "admin " : "",
+				(int)msg->buffer->len, msg->buffer->data);
+		if(msg->transaction != NULL)
+			janus_zeromq_idempotency_store(msg->admin, msg->client, msg->transaction, msg->buffer);
+		/* The buffer now belongs to ZeroMQ (or to the batch of the peer) */
+		janus_zeromq_buffer *buffer = msg->buffer;
+		msg->buffer = NULL;
+		if(msg->topic > 0) {
+			if(janus_zeromq_publish(msg->topic, buffer) < 0)
+				JANUS_LOG(LOG_ERR, "Error publishing ZeroMQ event: %s\n", zmq_strerror(errno));
+		} else {
+			janus_zeromq_deliver(msg->admin, msg->client, buffer, msg->request.batched);
+		}
+		janus_zeromq_outgoing_free(msg);
+		msg = next;
+	}
+}
+
+/* Helper to queue a buffer for the thread owning the sockets */
+static void janus_zeromq_queue_buffer(gboolean admin, janus_zeromq_client *client, janus_zeromq_buffer *buffer, char *transaction, janus_zeromq_request_id *request) {
+	janus_zeromq_outgoing *msg = g_malloc(sizeof(janus_zeromq_outgoing));
+	msg->next = NULL;
+	msg->admin = admin;
+	msg->client = client;
+	janus_zeromq_client_ref(client);
+	msg->buffer = buffer;
+	msg->transaction = transaction;
+	if(request != NULL)
+		msg->request = *request;
+	else
+		msg->request = (janus_zeromq_request_id){ 0 };
+	msg->topic = 0;
+	msg->stream = NULL;
+	janus_zeromq_mailbox_push(&mailbox, msg);
+}
+
+/* Helper to queue an event to publish for a session */
+static void janus_zeromq_queue_publication(guint64 session_id, janus_zeromq_buffer *buffer) {
+	janus_zeromq_outgoing *msg = g_malloc(sizeof(janus_zeromq_outgoing));
+	msg->next = NULL;
+	msg->admin = FALSE;
+	msg->client = NULL;
+	msg->buffer = buffer;
+	msg->transaction = NULL;
+	msg->request = (janus_zeromq_request_id){ 0 };
+	msg->topic = session_id;
+	msg->stream = NULL;
+	janus_zeromq_mailbox_push(&mailbox, msg);
+}
+
+/* Serialization state of a reply that may have to be chunked */
+typedef struct janus_zeromq_chunker {
+	gboolean admin;					/* Whether this is for the Admin or Janus API */
+	janus_zeromq_client *client;	/* Peer to send the reply to */
+	janus_zeromq_buffer *buffer;	/* Chunk being filled */
+	janus_zeromq_stream *stream;	/* NULL until the reply turns out to be larger than a chunk */
+	janus_zeromq_request_id request;	/* Request this is a reply to */
+} janus_zeromq_chunker;
+
+/* Helper to queue a chunk of a reply for the thread owning the sockets: if
+ * that's not the thread we're on, this waits until no more than chunk_window
+ * chunks of the reply are queued, and returns -1 if the reply was aborted,
+ * which is what we do if that doesn't happen within chunk_timeout */
+static int janus_zeromq_queue_chunk(janus_zeromq_chunker *chunker, janus_zeromq_buffer *buffer, gboolean last) {
+	janus_zeromq_stream *stream = chunker->stream;
+	janus_zeromq_outgoing *msg = g_malloc(sizeof(janus_zeromq_outgoing));
+	msg->next = NULL;
+	msg->admin = chunker->admin;
+	msg->client = chunker->client;
+	janus_zeromq_client_ref(chunker->client);
+	msg->buffer = buffer;
+	msg->transaction = NULL;
+	/* The reply is timed when its last chunk is picked up */
+	msg->request = last ? chunker->request : (janus_zeromq_request_id){ 0 };
+	msg->topic = 0;
+	msg->stream = stream;
+	g_atomic_int_inc(&stream->ref);
+	msg->chunk = stream->next++;
+	msg->last = last;
+	janus_mutex_lock(&stream->mutex);
+	stream->queued++;
+	janus_mutex_unlock(&stream->mutex);
+	janus_zeromq_mailbox_push(&mailbox, msg);
+	if(last)
+		return 0;
+	gboolean wait = (g_thread_self() != zeromq_thread);
+	gint64 deadline = g_get_monotonic_time() + chunk_timeout;
+	janus_mutex_lock(&stream->mutex);
+	while(wait && !stream->failed && stream->queued >= chunk_window && !g_atomic_int_get(&stopping)) {
+		gint64 now = g_get_monotonic_time();
+		if(now >= deadline) {
+			/* The peer isn't draining the reply: abort it, so that we don't
+			 * hold this thread forever (the chunks still queued are dropped) */
+			JANUS_LOG(LOG_WARN, "ZeroMQ peer not draining chunked reply %u, aborting it\n", stream->id);
+			stream->failed = TRUE;
+			break;
+		}
+		janus_condition_wait_until(&stream->cond, &stream->mutex, MIN(deadline, now + G_USEC_PER_SEC/10));
+	}
+	gboolean aborted = stream->failed || g_atomic_int_get(&stopping);
+	janus_mutex_unlock(&stream->mutex);
+	return aborted ? -1 : 0;
+}
+
+static int janus_zeromq_chunker_dump_cb(const char *data, size_t size, void *user_data) {
+	janus_zeromq_chunker *chunker = (janus_zeromq_chunker *)user_data;
+	while(size > 0) {
+		if(chunker->buffer->len == chunk_size) {
+			/* The reply doesn't fit in a chunk: queue what we have, and start the next one */
+			if(chunker->stream == NULL)
+				chunker->stream = janus_zeromq_stream_new();
+			janus_zeromq_buffer *buffer = chunker->buffer;
+			chunker->buffer = janus_zeromq_buffer_get();
+			if(janus_zeromq_queue_chunk(chunker, buffer, FALSE) < 0)
+				return -1;
+		}
+		size_t len = MIN(size, chunk_size - chunker->buffer->len);
+		janus_zeromq_buffer_append(chunker->buffer, data, len);
+		data += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/* Helper to quickly look for a top level property in a JSON request without
+ * parsing it: only works for scalar values, and returns a pointer to the
+ * (unescaped) value in the buffer, or NULL if the property wasn't found */
+static const char *janus_zeromq_json_peek(const char *buf, size_t len, const char *key, size_t *value_len) {
+	size_t klen = strlen(key), i = 0;
+	int depth = 0;
+	while(i < len) {
+		char c = buf[i];
+		if(c == '{' || c == '[') {
+			depth++;
+		} else if(c == '}' || c == ']') {
+			depth--;
+		} else if(c == '"') {
+			/* Find the end of the string */
+			size_t start = ++i;
+			while(i < len && buf[i] != '"')
+				i += (buf[i] == '\\') ? 2 : 1;
+			if(i >= len)
+				return NULL;
+			size_t end = i;
+			if(depth != 1)
+				goto next;
+			/* Only keys are followed by a colon */
+			size_t j = i + 1;
+			while(j < len && isspace(buf[j]))
+				j++;
+			if(j >= len || buf[j] != ':')
+				goto next;
+			if(end - start != klen || memcmp(buf + start, key, klen)) {
+				i = j;
+				goto next;
+			}
+			j++;
+			while(j < len && isspace(buf[j]))
+				j++;
+			if(j >= len)
+				return NULL;
+			size_t k = j;
+			if(buf[j] == '"') {
+				k = ++j;
+				while(k < len && buf[k] != '"')
+					k += (buf[k] == '\\') ? 2 : 1;
+				if(k >= len)
+					return NULL;
+			} else {
+				while(k < len && buf[k] != ',' && buf[k] != '}' && !isspace(buf[k]))
+					k++;
+			}
+			*value_len = k - j;
+			return buf + j;
+		}
+next:
+		i++;
+	}
+	return NULL;
+}
+
+static guint64 janus_zeromq_json_peek_uint64(const char *buf, size_t len, const char *key) {
+	size_t vlen = 0;
+	const char *value = janus_zeromq_json_peek(buf, len, key, &vlen);
+	guint64 result = 0;
+	for(size_t i = 0; value && i < vlen && isdigit(value[i]); i++)
+		result = result * 10 + (value[i] - '0');
+	return result;
+}
+
+/* Admission control for a request that came in a batch (which was admitted
+ * as a whole): each is subject to the same checks as if it came on its own,
+ * and either accounted for as in flight, or rejected with an overload error */
+static gboolean janus_zeromq_admit_batched(janus_zeromq_client *client, gboolean admin, json_t *request) {
+	const char *reason = NULL;
+	const char *verb = json_string_value(json_object_get(request, "janus"));
+	gboolean priority = (verb != NULL && (!strcmp(verb, "keepalive") || !strcmp(verb, "ping")));
+	if(g_atomic_int_get(&overloaded) && !admin && !priority)
+		reason = "Server overloaded";
+	else if(max_inflight > 0 && (guint)g_atomic_int_get(&client->inflight) >= max_inflight)
+		reason = "Too many requests in flight";
+	if(reason == NULL) {
+		g_atomic_int_inc(&client->inflight);
+		return TRUE;
+	}
+	g_atomic_int_inc(&requests_shed);
+	JANUS_LOG(LOG_HUGE, "Rejecting batched ZeroMQ %srequest: %s\n", admin ? "admin " : "", reason);
+	json_t *error = json_pack("{sss{sisssi}}", "janus", "error", "error",
+		"code", JANUS_ZEROMQ_ERROR_OVERLOADED, "reason", reason, "retry_after", retry_after);
+	json_t *transaction = json_object_get(request, "transaction");
+	if(transaction != NULL)
+		json_object_set(error, "transaction", transaction);
+	janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+	janus_zeromq_encode(g_atomic_int_get(&client->codec), error, buffer);
+	json_decref(error);
+	janus_zeromq_request_id batched = { .received = 0, .verb = 0, .batched = TRUE };
+	janus_zeromq_queue_buffer(admin, client, buffer, NULL, &batched);
+	return FALSE;
+}
+
+/* Accounts for a request we're passing to the core, and returns the request ID to pass along */
+static janus_zeromq_request_id *janus_zeromq_request_id_new(janus_zeromq_stats *stats, gboolean admin, json_t *request, gint64 received, gint64 now) {
+	janus_zeromq_request_id *request_id = g_malloc(sizeof(janus_zeromq_request_id));
+	request_id->received = received;
+	request_id->verb = janus_zeromq_stats_verb(request);
+	request_id->batched = FALSE;
+	stats->api[admin].verbs[request_id->verb].received++;
+	janus_zeromq_histogram_add(&stats->api[admin].verbs[request_id->verb].queue, now - received);
+	return request_id;
+}
+
+/* Parses a request and passes it to the core: called either by the thread
+ * that owns the socket, or by the workers, and takes ownership of the request */
+static void janus_zeromq_process_request(janus_zeromq_request *request) {
+	const char *payload = zmq_msg_data(&request->message);
+	size_t len = zmq_msg_size(&request->message);
+	janus_zeromq_codec codec = g_atomic_int_get(&request->client->codec);
+	if(codec == janus_zeromq_codec_json)
+		JANUS_LOG(LOG_HUGE, "Received ZeroMQ %smessage: %.*s\n", request->admin ? "admin " : "", (int)len, payload);
+	else
+		JANUS_LOG(LOG_HUGE, "Received ZeroMQ %sMessagePack message (%zu bytes)\n", request->admin ? "admin " : "", len);
+	
+	/* Decode straight from the frame, which we then don't need anymore */
+	json_error_t error;
+	json_t *root = janus_zeromq_decode(codec, payload, len, &error);
+	char *transaction = NULL;
+	if(root == NULL && idempotency && codec == janus_zeromq_codec_json) {
+		/* We may be tracking the transaction: if so, the error is what retries get */
+		size_t tlen = 0;
+		const char *t = janus_zeromq_json_peek(payload, len, "transaction", &tlen);
+		if(t != NULL && tlen > 0)
+			transaction = g_strndup(t, tlen);
+	}
+	zmq_msg_close(&request->message);
+	
+	janus_zeromq_stats *stats = janus_zeromq_stats_get();
+	if(!root) {
+		JANUS_LOG(LOG_ERR, "Parsing error: %s\n", error.text);
+		stats->api[request->admin].parse_failures++;
+		/* Send error response, with the same codec the peer used */
+		json_t *error_response = json_pack("{sss{siss}}", "janus", "error", "error",
+			"code", JANUS_ZEROMQ_ERROR_INVALID_REQUEST, "reason", codec == janus_zeromq_codec_json ? "Invalid JSON" : "Invalid MessagePack");
+		janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+		janus_zeromq_encode(codec, error_response, buffer);
+		json_decref(error_response);
+		janus_zeromq_queue_buffer(request->admin, request->client, buffer, transaction, NULL);
+		janus_zeromq_client_settle(request->client, 1);
+		janus_zeromq_client_unref(request->client);
+		g_free(request);
+		return;
+	}
+	
+	/* Pass to gateway, using the transport session of the peer: the gateway takes ownership
+	 * of root, and we pass a request ID too (to time the reply), as the core gives that back
+	 * with the replies to requests, while asynchronous events have no request ID */
+	janus_zeromq_client *client = request->client;
+	gboolean admin = request->admin;
+	gint64 received = request->received, now = g_get_monotonic_time();
+	g_free(request);
+	if(batching && json_is_array(root) && client->envelope.identity_len > 0 && json_array_size(root) > batch_max) {
+		/* Too many requests in a single batch, reject it as a whole */
+		JANUS_LOG(LOG_WARN, "ZeroMQ %sbatch too large (%zu requests), rejecting it\n",
+			admin ? "admin " : "", json_array_size(root));
+		json_decref(root);
+		json_t *error_response = json_pack("{sss{siss}}", "janus", "error", "error",
+			"code", JANUS_ZEROMQ_ERROR_INVALID_REQUEST, "reason", "Batch too large");
+		janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+		janus_zeromq_encode(codec, error_response, buffer);
+		json_decref(error_response);
+		janus_zeromq_queue_buffer(admin, client, buffer, NULL, NULL);
+		janus_zeromq_client_settle(client, 1);
+	} else if(batching && json_is_array(root) && client->envelope.identity_len > 0) {
+		/* This is a batch: pass all requests to the gateway, in order,
+		 * and tag them, so that their replies are coalesced as well */
+		/* We admitted the batch as a single request: the requests in it go
+		 * through admission control one by one, and the ones that get in
+		 * are settled when the core replies to them */
+		size_t i = 0;
+		janus_zeromq_client_settle(client, 1);
+		for(i = 0; i < json_array_size(root); i++) {
+			json_t *item = json_array_get(root, i);
+			if(!janus_zeromq_admit_batched(client, admin, item))
+				continue;
+			json_incref(item);
+			janus_zeromq_request_id *request_id = janus_zeromq_request_id_new(stats, admin, item, received, now);
+			request_id->batched = TRUE;
+			gateway->incoming_request(&janus_zeromq_transport, &client->transport, request_id, admin, item, NULL);
+		}
+		json_decref(root);
+	} else {
+		janus_zeromq_request_id *request_id = janus_zeromq_request_id_new(stats, admin, root, received, now);
+		gateway->incoming_request(&janus_zeromq_transport, &client->transport, request_id, admin, root, NULL);
+	}
+	janus_zeromq_client_unref(client);
 }
 
-const char *janus_zeromq_get_author(void) {
-	return JANUS_ZEROMQ_AUTHOR;
+/* Worker queues */
+static void janus_zeromq_worker_queue_push(janus_zeromq_worker_queue *queue, janus_zeromq_request *request) {
+	janus_mutex_lock(&queue->mutex);
+	g_queue_push_tail(&queue->lanes[request->lane], request);
+	janus_condition_signal(&queue->cond);
+	janus_mutex_unlock(&queue->mutex);
 }
 
-const char *janus_zeromq_get_package(void) {
-	return JANUS_ZEROMQ_PACKAGE;
+static janus_zeromq_request *janus_zeromq_worker_queue_pop(janus_zeromq_worker_queue *queue) {
+	janus_mutex_lock(&queue->mutex);
+	GQueue *priority = &queue->lanes[JANUS_ZEROMQ_LANE_PRIORITY], *normal = &queue->lanes[JANUS_ZEROMQ_LANE_NORMAL];
+	while(g_queue_is_empty(priority) && g_queue_is_empty(normal))
+		janus_condition_wait(&queue->cond, &queue->mutex);
+	janus_zeromq_request *request = NULL;
+	if(!g_queue_is_empty(priority) && (queue->burst < priority_budget || g_queue_is_empty(normal))) {
+		request = g_queue_pop_head(priority);
+		queue->burst++;
+	} else {
+		request = g_queue_pop_head(normal);
+		queue->burst = 0;
+	}
+	janus_mutex_unlock(&queue->mutex);
+	return request;
 }
 
-gboolean janus_zeromq_is_janus_api_enabled(void) {
-	return zeromq_janus_api_enabled;
+/* Helper to classify requests in lanes, without parsing them */
+static guint janus_zeromq_classify(janus_zeromq_request *request) {
+	if(workers_num == 0 || priority_budget == 0 || g_atomic_int_get(&request->client->codec) != janus_zeromq_codec_json)
+		return JANUS_ZEROMQ_LANE_NORMAL;
+	size_t len = 0;
+	const char *verb = janus_zeromq_json_peek(zmq_msg_data(&request->message),
+		zmq_msg_size(&request->message), "janus", &len);
+	if(verb != NULL && ((len == 9 && !strncmp(verb, "keepalive", len)) || (len == 4 && !strncmp(verb, "ping", len))))
+		return JANUS_ZEROMQ_LANE_PRIORITY;
+	return JANUS_ZEROMQ_LANE_NORMAL;
 }
 
-gboolean janus_zeromq_is_admin_api_enabled(void) {
-	return zeromq_admin_api_enabled;
+/* Hands a request to the right worker, or processes it inline if there are no workers */
+static void janus_zeromq_dispatch(janus_zeromq_request *request) {
+	if(workers_num == 0) {
+		janus_zeromq_process_request(request);
+		return;
+	}
+	guint64 hash = janus_zeromq_json_peek_uint64(zmq_msg_data(&request->message),
+		zmq_msg_size(&request->message), "session_id");
+	if(hash == 0 && request->client->envelope.identity_len > 0) {
+		/* No session yet, stick to the peer instead */
+		hash = janus_zeromq_client_hash(request->client);
+	} else if(hash == 0) {
+		/* No way to tell who this is from (REP mode), any worker will do */
+		hash = (guint)g_atomic_int_add(&worker_next, 1);
+	}
+	g_atomic_int_inc(&requests_queued);
+	janus_zeromq_worker_queue_push(&worker_queues[hash % workers_num], request);
 }
 
-/* Session management */
-static void janus_zeromq_transport_session_free(gpointer data) {
-	janus_transport_session *session = (janus_transport_session *)data;
-	if(session) {
-		g_free(session);
+/* Worker thread */
+static void *janus_zeromq_worker(void *data) {
+	janus_zeromq_worker_queue *queue = (janus_zeromq_worker_queue *)data;
+	JANUS_LOG(LOG_VERB, "Joining ZeroMQ worker thread...\n");
+	janus_zeromq_thread_pin(thread_affinity);
+	janus_zeromq_request *request = NULL;
+	while(!g_atomic_int_get(&stopping)) {
+		request = janus_zeromq_worker_queue_pop(queue);
+		if(request == &exit_request)
+			break;
+		if(g_atomic_int_add(&requests_queued, -1) == (gint)fair_window && fair) {
+			/* There's room for more requests now, let the ZeroMQ thread know */
+			janus_zeromq_mailbox_wakeup(&mailbox);
+		}
+		janus_zeromq_process_request(request);
 	}
+	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ worker thread...\n");
+	return NULL;
 }
 
 /* Initialization */
@@ -172,22 +2217,18 @@ int janus_zeromq_init(janus_transport_callbacks *callback, const char *config_pa
 		return -1;
 	}
 
-	/* Initialize ZeroMQ context */
-	zmq_context = zmq_ctx_new();
-	if(zmq_context == NULL) {
-		JANUS_LOG(LOG_FATAL, "Could not initialize ZeroMQ context: %s\n", zmq_strerror(errno));
-		return -1;
-	}
-
-	/* Set context options */
-	zmq_ctx_set(zmq_context, ZMQ_IO_THREADS, 4);
-	zmq_ctx_set(zmq_context, ZMQ_MAX_SOCKETS, 1024);
-
-	/* Store the callbacks and initialize sessions */
+	/* Store the callbacks and initialize peers and sessions */
 	gateway = callback;
-	sessions = g_hash_table_new_full(g_int64_hash, g_int64_equal, 
-		(GDestroyNotify)g_free, (GDestroyNotify)janus_zeromq_transport_session_free);
-	janus_mutex_init(&sessions_mutex);
+	janus_peers = g_hash_table_new_full(janus_zeromq_client_hash, janus_zeromq_client_equal,
+		(GDestroyNotify)janus_zeromq_client_unref, NULL);
+	admin_peers = g_hash_table_new_full(janus_zeromq_client_hash, janus_zeromq_client_equal,
+		(GDestroyNotify)janus_zeromq_client_unref, NULL);
+	guint i = 0;
+	for(i = 0; i < JANUS_ZEROMQ_SESSIONS_STRIPES; i++) {
+		janus_mutex_init(&sessions[i].mutex);
+		/* The key is the session_id in the value, so we only free the latter */
+		sessions[i].sessions = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)janus_zeromq_session_free);
+	}
 
 	/* Read configuration */
 	char filename[255];
@@ -221,6 +2262,14 @@ int janus_zeromq_init(janus_transport_callbacks *callback, const char *config_pa
 				port = atoi(item->value);
 			else
 				port = 5545;
+
+			item = janus_config_get(config, config_general, janus_config_type_item, "mode");
+			janus_socket_type = janus_zeromq_parse_mode(item ? item->value : NULL, "Janus");
+			item = janus_config_get(config, config_general, janus_config_type_item, "endpoints");
+			endpoints = janus_zeromq_parse_endpoints(item ? item->value : NULL);
+			
+			item = janus_config_get(config, config_general, janus_config_type_item, "codec");
+			janus_codec = janus_zeromq_parse_codec(item ? item->value : NULL, "Janus");
 		}
 		
 		janus_config_category *config_admin = janus_config_get_create(config, NULL, janus_config_type_category, "admin");
@@ -239,47 +2288,338 @@ int janus_zeromq_init(janus_transport_callbacks *callback, const char *config_pa
 				admin_port = atoi(item->value);
 			else
 				admin_port = 7445;
+
+			item = janus_config_get(config, config_admin, janus_config_type_item, "admin_mode");
+			admin_socket_type = janus_zeromq_parse_mode(item ? item->value : NULL, "Admin");
+			item = janus_config_get(config, config_admin, janus_config_type_item, "admin_endpoints");
+			admin_endpoints = janus_zeromq_parse_endpoints(item ? item->value : NULL);
+			
+			item = janus_config_get(config, config_admin, janus_config_type_item, "admin_codec");
+			admin_codec = janus_zeromq_parse_codec(item ? item->value : NULL, "Admin");
+		}
+		
+		/* Whether peers can send batches of requests, and how their replies should be coalesced */
+		item = janus_config_get(config, config_general, janus_config_type_item, "batching");
+		if(item && item->value)
+			batching = janus_is_true(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "batch_size");
+		if(item && item->value) {
+			int size = atoi(item->value);
+			if(size < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid batch size (%d), using default (%u)\n", size, batch_size);
+			} else {
+				batch_size = size;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "batch_max");
+		if(item && item->value) {
+			int max = atoi(item->value);
+			if(max < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid maximum batch length (%d), using default (%u)\n", max, batch_max);
+			} else {
+				batch_max = max;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "batch_window");
+		if(item && item->value) {
+			int window = atoi(item->value);
+			if(window < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid batch window (%d), using default (%"SCNi64"ms)\n", window, batch_window/1000);
+			} else {
+				batch_window = (gint64)window * 1000;
+			}
+		}
+		if(batching && janus_socket_type != ZMQ_ROUTER && admin_socket_type != ZMQ_ROUTER) {
+			JANUS_LOG(LOG_WARN, "Batching is only supported in ROUTER mode, disabling it\n");
+			batching = FALSE;
+		}
+		
+		/* Whether large replies should be sent in chunks */
+		item = janus_config_get(config, config_general, janus_config_type_item, "chunk_size");
+		if(item && item->value) {
+			int size = atoi(item->value);
+			if(size < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid chunk size (%d), not chunking replies\n", size);
+			} else {
+				chunk_size = size;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "chunk_window");
+		if(item && item->value) {
+			int window = atoi(item->value);
+			if(window < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid chunk window (%d), using default (%d)\n", window, chunk_window);
+			} else {
+				chunk_window = window;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "chunk_timeout");
+		if(item && item->value) {
+			int timeout = atoi(item->value);
+			if(timeout < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid chunk timeout (%d), using default (%"SCNi64"ms)\n", timeout, chunk_timeout/1000);
+			} else {
+				chunk_timeout = (gint64)timeout * 1000;
+			}
+		}
+		if(chunk_size > 0 && janus_socket_type != ZMQ_ROUTER && admin_socket_type != ZMQ_ROUTER) {
+			JANUS_LOG(LOG_WARN, "Chunked replies are only supported in ROUTER mode, disabling them\n");
+			chunk_size = 0;
+		}
+		
+		/* Number of workers parsing requests and passing them to the core (0 means the socket threads do it) */
+		item = janus_config_get(config, config_general, janus_config_type_item, "workers");
+		if(item && item->value) {
+			int num = atoi(item->value);
+			if(num < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid number of workers (%d), processing requests inline\n", num);
+				num = 0;
+			}
+			workers_num = num;
+		}
+		
+		/* Admission control and overload shedding */
+		item = janus_config_get(config, config_general, janus_config_type_item, "max_inflight");
+		if(item && item->value) {
+			int num = atoi(item->value);
+			if(num < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid maximum number of requests in flight (%d), disabling the limit\n", num);
+				num = 0;
+			}
+			max_inflight = num;
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "queue_high_watermark");
+		if(item && item->value) {
+			int num = atoi(item->value);
+			if(num < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid queue high watermark (%d), disabling shedding\n", num);
+				num = 0;
+			}
+			queue_high_watermark = num;
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "queue_low_watermark");
+		if(item && item->value && atoi(item->value) >= 0)
+			queue_low_watermark = atoi(item->value);
+		else
+			queue_low_watermark = queue_high_watermark / 2;
+		if(queue_low_watermark > queue_high_watermark) {
+			JANUS_LOG(LOG_WARN, "Queue low watermark above the high watermark, using %u\n", queue_high_watermark / 2);
+			queue_low_watermark = queue_high_watermark / 2;
+		}
+		if(queue_high_watermark > 0 && workers_num == 0)
+			JANUS_LOG(LOG_WARN, "Queue watermarks have no effect without workers\n");
+		item = janus_config_get(config, config_general, janus_config_type_item, "retry_after");
+		if(item && item->value) {
+			int ms = atoi(item->value);
+			if(ms < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid retry hint (%d), using default (%ums)\n", ms, retry_after);
+			} else {
+				retry_after = ms;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "recv_hwm");
+		if(item && item->value)
+			recv_hwm = MAX(0, atoi(item->value));
+		item = janus_config_get(config, config_general, janus_config_type_item, "send_hwm");
+		if(item && item->value)
+			send_hwm = MAX(0, atoi(item->value));
+		
+		/* ZeroMQ I/O threads, and where our own threads should run */
+		item = janus_config_get(config, config_general, janus_config_type_item, "io_threads");
+		if(item && item->value)
+			context_settings.io_threads = MAX(0, atoi(item->value));
+		item = janus_config_get(config, config_general, janus_config_type_item, "io_affinity");
+		if(item && item->value)
+			context_settings.io_affinity = g_strdup(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "io_sched_policy");
+		if(item && item->value)
+			context_settings.io_sched_policy = g_strdup(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "io_sched_priority");
+		if(item && item->value)
+			context_settings.io_sched_priority = atoi(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "thread_affinity");
+		if(item && item->value)
+			thread_affinity = g_strdup(item->value);
+		
+		/* Whether asynchronous session events should be published on a PUB socket too */
+		item = janus_config_get(config, config_general, janus_config_type_item, "publish");
+		if(item && item->value && janus_is_true(item->value) && zeromq_janus_api_enabled) {
+			item = janus_config_get(config, config_general, janus_config_type_item, "publish_address");
+			if(item && item->value)
+				publish_address = g_strdup(item->value);
+			else
+				publish_address = g_strdup(address);
+			item = janus_config_get(config, config_general, janus_config_type_item, "publish_port");
+			if(item && item->value)
+				publish_port = atoi(item->value);
+			else
+				publish_port = 5547;
+		}
+		
+		/* Whether we should monitor connections, and release peers that went away */
+		item = janus_config_get(config, config_general, janus_config_type_item, "monitor");
+		if(item && item->value)
+			monitor = janus_is_true(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "disconnect_grace");
+		if(item && item->value) {
+			int grace = atoi(item->value);
+			if(grace < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid disconnect grace period (%d), using default (%"SCNi64"s)\n", grace, disconnect_grace/G_USEC_PER_SEC);
+			} else {
+				disconnect_grace = (gint64)grace * G_USEC_PER_SEC;
+			}
+		}
+		if(monitor && janus_socket_type != ZMQ_ROUTER && admin_socket_type != ZMQ_ROUTER) {
+			JANUS_LOG(LOG_WARN, "Peers can only be monitored in ROUTER mode, disabling monitoring\n");
+			monitor = FALSE;
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "heartbeat_interval");
+		if(item && item->value)
+			heartbeat_interval = MAX(0, atoi(item->value));
+		if(heartbeat_interval > 0) {
+			heartbeat_timeout = 3 * heartbeat_interval;
+			item = janus_config_get(config, config_general, janus_config_type_item, "heartbeat_timeout");
+			if(item && item->value && atoi(item->value) > 0)
+				heartbeat_timeout = atoi(item->value);
+			heartbeat_ttl = heartbeat_timeout;
+			item = janus_config_get(config, config_general, janus_config_type_item, "heartbeat_ttl");
+			if(item && item->value && atoi(item->value) > 0)
+				heartbeat_ttl = atoi(item->value);
+		}
+		
+		/* Whether retries of recent requests should be detected, and for how long */
+		item = janus_config_get(config, config_general, janus_config_type_item, "idempotency");
+		if(item && item->value)
+			idempotency = janus_is_true(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "idempotency_size");
+		if(item && item->value) {
+			int num = atoi(item->value);
+			if(num < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid idempotency cache size (%d), using default (%u)\n", num, idempotency_size);
+			} else {
+				idempotency_size = num;
+			}
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "idempotency_ttl");
+		if(item && item->value) {
+			int ttl = atoi(item->value);
+			if(ttl < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid idempotency TTL (%d), using default (%"SCNi64"s)\n", ttl, idempotency_ttl/G_USEC_PER_SEC);
+			} else {
+				idempotency_ttl = (gint64)ttl * G_USEC_PER_SEC;
+			}
+		}
+		
+		/* How many priority requests (keepalives, pings) workers can serve in a row */
+		item = janus_config_get(config, config_general, janus_config_type_item, "priority_budget");
+		if(item && item->value) {
+			int num = atoi(item->value);
+			if(num < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid priority budget (%d), using default (%u)\n", num, priority_budget);
+			} else {
+				priority_budget = num;
+			}
+		}
+		
+		/* Fair scheduling of the requests of different peers */
+		item = janus_config_get(config, config_general, janus_config_type_item, "fair");
+		if(item && item->value)
+			fair = janus_is_true(item->value);
+		if(fair && workers_num == 0) {
+			JANUS_LOG(LOG_WARN, "Fair scheduling needs workers, disabling it\n");
+			fair = FALSE;
+		}
+		if(fair) {
+			fair_window = 4 * workers_num;
+			item = janus_config_get(config, config_general, janus_config_type_item, "fair_window");
+			if(item && item->value) {
+				int num = atoi(item->value);
+				if(num < 1) {
+					JANUS_LOG(LOG_WARN, "Invalid fair scheduling window (%d), using default (%u)\n", num, fair_window);
+				} else {
+					fair_window = num;
+				}
+			}
+			/* Weights are a comma separated list of identity=weight or address=weight */
+			item = janus_config_get(config, config_general, janus_config_type_item, "fair_weights");
+			if(item && item->value) {
+				fair_weights = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
+				gchar **list = g_strsplit(item->value, ",", -1);
+				int i = 0;
+				for(i = 0; list[i] != NULL; i++) {
+					gchar *entry = g_strstrip(list[i]);
+					gchar *sep = strrchr(entry, '=');
+					int weight = sep ? atoi(sep + 1) : 0;
+					if(sep == NULL || sep == entry || weight < 1) {
+						JANUS_LOG(LOG_WARN, "Invalid fair scheduling weight '%s', skipping\n", entry);
+						continue;
+					}
+					*sep = '\0';
+					g_hash_table_insert(fair_weights, g_strdup(g_strstrip(entry)), GUINT_TO_POINTER(weight));
+				}
+				g_strfreev(list);
+			}
 		}
 		
 		janus_config_destroy(config);
 	}
 
+	if(!zeromq_janus_api_enabled && !zeromq_admin_api_enabled) {
+		JANUS_LOG(LOG_WARN, "ZeroMQ transport disabled (Janus API and Admin API)\n");
+	} else {
+		/* Get a reference to the ZeroMQ context we share with the event handler */
+		zmq_context = janus_zeromq_context_ref(&context_settings, JANUS_ZEROMQ_NAME);
+		if(zmq_context == NULL)
+			return -1;
+	}
+
+	/* Start the workers, if any */
+	if(workers_num > 0 && (zeromq_janus_api_enabled || zeromq_admin_api_enabled)) {
+		workers = g_malloc0(workers_num * sizeof(GThread *));
+		worker_queues = g_malloc0(workers_num * sizeof(janus_zeromq_worker_queue));
+		guint i = 0;
+		for(i = 0; i < workers_num; i++) {
+			janus_mutex_init(&worker_queues[i].mutex);
+			janus_condition_init(&worker_queues[i].cond);
+			g_queue_init(&worker_queues[i].lanes[JANUS_ZEROMQ_LANE_PRIORITY]);
+			g_queue_init(&worker_queues[i].lanes[JANUS_ZEROMQ_LANE_NORMAL]);
+			char tname[16];
+			g_snprintf(tname, sizeof(tname), "zeromq_w%u", i);
+			GError *error = NULL;
+			workers[i] = g_thread_try_new(tname, janus_zeromq_worker, &worker_queues[i], &error);
+			if(error != NULL) {
+				JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch ZeroMQ worker #%u...\n",
+					error->code, error->message ? error->message : "??", i);
+				g_error_free(error);
+				return -1;
+			}
+		}
+		JANUS_LOG(LOG_INFO, "Started %u ZeroMQ workers\n", workers_num);
+	}
+
 	/* Setup Janus API socket */
 	if(zeromq_janus_api_enabled) {
 		char bind_address[256];
 		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", address, port);
 		
-		zmq_socket = zmq_socket(zmq_context, ZMQ_REP);
-		if(zmq_socket == NULL) {
-			JANUS_LOG(LOG_FATAL, "Could not create ZeroMQ socket: %s\n", zmq_strerror(errno));
+		zmq_janus_socket = janus_zeromq_create_socket(janus_socket_type, bind_address, endpoints, FALSE);
+		if(zmq_janus_socket == NULL)
 			return -1;
-		}
 		
-		/* Set socket options */
-		int linger = 0;
-		zmq_setsockopt(zmq_socket, ZMQ_LINGER, &linger, sizeof(linger));
-		
-		/* Set receive timeout */
-		int timeout = 1000; /* 1 second */
-		zmq_setsockopt(zmq_socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+		JANUS_LOG(LOG_INFO, "ZeroMQ Janus API bound to %s (%s)\n", bind_address,
+			janus_socket_type == ZMQ_ROUTER ? "router" : "rep");
+	}
+
+	/* Setup the socket to publish session events on, if needed */
+	if(publish_address != NULL) {
+		char bind_address[256];
+		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", publish_address, publish_port);
 		
-		if(zmq_bind(zmq_socket, bind_address) < 0) {
-			JANUS_LOG(LOG_FATAL, "Could not bind ZeroMQ socket to %s: %s\n", 
-				bind_address, zmq_strerror(errno));
+		zmq_publish_socket = janus_zeromq_create_socket(ZMQ_PUB, bind_address, NULL, FALSE);
+		if(zmq_publish_socket == NULL)
 			return -1;
-		}
-		
-		JANUS_LOG(LOG_INFO, "ZeroMQ Janus API bound to %s\n", bind_address);
 		
-		/* Start thread */
-		GError *error = NULL;
-		zeromq_thread = g_thread_try_new("zeromq", janus_zeromq_thread, NULL, &error);
-		if(error != NULL) {
-			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the ZeroMQ thread...\n",
-				error->code, error->message ? error->message : "??");
-			g_error_free(error);
-			return -1;
-		}
+		JANUS_LOG(LOG_INFO, "ZeroMQ session events published on %s\n", bind_address);
 	}
 
 	/* Setup Admin API socket */
@@ -287,33 +2627,44 @@ int janus_zeromq_init(janus_transport_callbacks *callback, const char *config_pa
 		char bind_address[256];
 		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", admin_address, admin_port);
 		
-		zmq_admin_socket = zmq_socket(zmq_context, ZMQ_REP);
-		if(zmq_admin_socket == NULL) {
-			JANUS_LOG(LOG_FATAL, "Could not create ZeroMQ admin socket: %s\n", zmq_strerror(errno));
+		zmq_admin_socket = janus_zeromq_create_socket(admin_socket_type, bind_address, admin_endpoints, TRUE);
+		if(zmq_admin_socket == NULL)
 			return -1;
-		}
-		
-		/* Set socket options */
-		int linger = 0;
-		zmq_setsockopt(zmq_admin_socket, ZMQ_LINGER, &linger, sizeof(linger));
 		
-		/* Set receive timeout */
-		int timeout = 1000; /* 1 second */
-		zmq_setsockopt(zmq_admin_socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
-		
-		if(zmq_bind(zmq_admin_socket, bind_address) < 0) {
-			JANUS_LOG(LOG_FATAL, "Could not bind ZeroMQ admin socket to %s: %s\n",
-				bind_address, zmq_strerror(errno));
+		JANUS_LOG(LOG_INFO, "ZeroMQ Admin API bound to %s (%s)\n", bind_address,
+			admin_socket_type == ZMQ_ROUTER ? "router" : "rep");
+	}
+
+	if(zeromq_janus_api_enabled || zeromq_admin_api_enabled) {
+		/* Create the mailbox for outgoing messages, and the control socket */
+		batch_timers = g_queue_new();
+		chunks_blocked = g_queue_new();
+		fair_peers = g_queue_new();
+		gone_timers = g_queue_new();
+		if(monitor && zmq_janus_socket != NULL && janus_socket_type == ZMQ_ROUTER)
+			zmq_janus_monitor = janus_zeromq_create_monitor(zmq_janus_socket, JANUS_ZEROMQ_JANUS_MONITOR_ENDPOINT, FALSE);
+		if(monitor && zmq_admin_socket != NULL && admin_socket_type == ZMQ_ROUTER)
+			zmq_admin_monitor = janus_zeromq_create_monitor(zmq_admin_socket, JANUS_ZEROMQ_ADMIN_MONITOR_ENDPOINT, TRUE);
+		if(idempotency && janus_socket_type != ZMQ_ROUTER && admin_socket_type != ZMQ_ROUTER)
+			JANUS_LOG(LOG_WARN, "Retries can only be detected on ROUTER sockets, idempotency has no effect\n");
+		if(idempotency) {
+			idempotency_cache = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+				NULL, (GDestroyNotify)janus_zeromq_idempotency_entry_free);
+			idempotency_queue = g_queue_new();
+		}
+		if(janus_zeromq_mailbox_init(&mailbox) < 0)
+			return -1;
+		zmq_control_socket = zmq_socket(zmq_context, ZMQ_PAIR);
+		if(zmq_control_socket == NULL || zmq_bind(zmq_control_socket, JANUS_ZEROMQ_CONTROL_ENDPOINT) < 0) {
+			JANUS_LOG(LOG_FATAL, "Could not create ZeroMQ control socket: %s\n", zmq_strerror(errno));
 			return -1;
 		}
-		
-		JANUS_LOG(LOG_INFO, "ZeroMQ Admin API bound to %s\n", bind_address);
-		
-		/* Start thread */
+
+		/* Start the thread that will own all the sockets */
 		GError *error = NULL;
-		zeromq_admin_thread = g_thread_try_new("zeromq_admin", janus_zeromq_admin_thread, NULL, &error);
+		zeromq_thread = g_thread_try_new("zeromq", janus_zeromq_thread, NULL, &error);
 		if(error != NULL) {
-			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the ZeroMQ admin thread...\n",
+			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the ZeroMQ thread...\n",
 				error->code, error->message ? error->message : "??");
 			g_error_free(error);
 			return -1;
@@ -326,163 +2677,493 @@ int janus_zeromq_init(janus_transport_callbacks *callback, const char *config_pa
 	return 0;
 }
 
-/* Thread for handling Janus API messages */
-static void *janus_zeromq_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "Joining ZeroMQ thread...\n");
-	
+/* Returns the transaction of a request, if it's one whose retries we detect */
+static const char *janus_zeromq_idempotency_transaction(janus_zeromq_request *request, size_t *len) {
+	int type = request->admin ? admin_socket_type : janus_socket_type;
+	if(!idempotency || type != ZMQ_ROUTER || request->lane == JANUS_ZEROMQ_LANE_PRIORITY ||
+			g_atomic_int_get(&request->client->codec) != janus_zeromq_codec_json)
+		return NULL;
+	const char *transaction = janus_zeromq_json_peek(zmq_msg_data(&request->message),
+		zmq_msg_size(&request->message), "transaction", len);
+	return (transaction != NULL && *len > 0) ? transaction : NULL;
+}
+
+/* Checks whether a request is a retry: if so, it either replays the reply we
+ * sent already, or drops the request if we're still working on it */
+static gboolean janus_zeromq_idempotency_check(janus_zeromq_request *request) {
+	size_t len = 0;
+	const char *transaction = janus_zeromq_idempotency_transaction(request, &len);
+	if(transaction == NULL)
+		return TRUE;
+	GBytes *key = janus_zeromq_idempotency_key(request->admin, request->client, transaction, len);
+	janus_zeromq_idempotency_entry *entry = g_hash_table_lookup(idempotency_cache, key);
+	g_bytes_unref(key);
+	if(entry != NULL && entry->expires <= g_get_monotonic_time()) {
+		/* Stale entry (e.g., a rejection whose retry hint is over): forget about it */
+		g_queue_delete_link(idempotency_queue, entry->link);
+		g_hash_table_remove(idempotency_cache, entry->key);
+		entry = NULL;
+	}
+	if(entry == NULL) {
+		/* First time we see this transaction (at least recently) */
+		return TRUE;
+	}
+	g_atomic_int_inc(&requests_retried);
+	if(entry->reply != NULL) {
+		JANUS_LOG(LOG_VERB, "Retried ZeroMQ %srequest (%.*s), sending the same reply again\n",
+			request->admin ? "admin " : "", (int)len, transaction);
+		janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+		janus_zeromq_buffer_append(buffer, entry->reply->data, entry->reply->len);
+		janus_zeromq_deliver(request->admin, request->client, buffer, FALSE);
+	} else {
+		JANUS_LOG(LOG_VERB, "Retried ZeroMQ %srequest (%.*s) still in flight, dropping it\n",
+			request->admin ? "admin " : "", (int)len, transaction);
+	}
+	zmq_msg_close(&request->message);
+	janus_zeromq_client_unref(request->client);
+	g_free(request);
+	return FALSE;
+}
+
+/* Starts tracking the transaction of a request we admitted (reply is NULL,
+ * as it's in flight) or rejected (reply is the rejection we sent) */
+static void janus_zeromq_idempotency_track(janus_zeromq_request *request, janus_zeromq_buffer *reply, gint64 lifetime) {
+	size_t len = 0;
+	const char *transaction = janus_zeromq_idempotency_transaction(request, &len);
+	if(transaction == NULL)
+		return;
+	janus_zeromq_idempotency_entry *entry = g_malloc0(sizeof(janus_zeromq_idempotency_entry));
+	entry->key = janus_zeromq_idempotency_key(request->admin, request->client, transaction, len);
+	entry->expires = g_get_monotonic_time() + lifetime;
+	if(reply != NULL) {
+		entry->reply = janus_zeromq_buffer_get();
+		janus_zeromq_buffer_append(entry->reply, reply->data, reply->len);
+	}
+	g_hash_table_insert(idempotency_cache, entry->key, entry);
+	g_queue_push_tail(idempotency_queue, entry);
+	entry->link = g_queue_peek_tail_link(idempotency_queue);
+	janus_zeromq_idempotency_expire();
+}
+
+/* Admission control: either accounts for the request as in flight, or
+ * rejects it with an overload error and gets rid of it */
+static gboolean janus_zeromq_admit(janus_zeromq_request *request) {
+	janus_zeromq_client *client = request->client;
+	const char *reason = NULL;
+	guint wait = retry_after;
+	if(queue_high_watermark > 0) {
+		guint queued = g_atomic_int_get(&requests_queued) + requests_pending;
+		if(!g_atomic_int_get(&overloaded) && queued >= queue_high_watermark) {
+			JANUS_LOG(LOG_WARN, "ZeroMQ request queues above the high watermark (%u), shedding Janus API requests\n", queued);
+			g_atomic_int_set(&overloaded, 1);
+		} else if(g_atomic_int_get(&overloaded) && queued <= queue_low_watermark) {
+			JANUS_LOG(LOG_INFO, "ZeroMQ request queues back below the low watermark (%u)\n", queued);
+			g_atomic_int_set(&overloaded, 0);
+		}
+		/* We never shed Admin API requests, as that's how we'd troubleshoot this,
+		 * nor priority requests, as they're cheap and sessions depend on them */
+		if(g_atomic_int_get(&overloaded) && !request->admin && request->lane != JANUS_ZEROMQ_LANE_PRIORITY) {
+			reason = "Server overloaded";
+			/* The longer the queues, the longer the peer should wait */
+			wait = retry_after * MAX(1, queued / MAX(1, queue_low_watermark));
+		}
+	}
+	if(reason == NULL && max_inflight > 0 && (guint)g_atomic_int_get(&client->inflight) >= max_inflight)
+		reason = "Too many requests in flight";
+	if(reason == NULL) {
+		g_atomic_int_inc(&client->inflight);
+		return TRUE;
+	}
+	g_atomic_int_inc(&requests_shed);
+	JANUS_LOG(LOG_HUGE, "Rejecting ZeroMQ %srequest: %s\n", request->admin ? "admin " : "", reason);
+	/* Reply right away, with the transaction if we can find it without parsing */
+	janus_zeromq_codec codec = g_atomic_int_get(&client->codec);
+	json_t *error = json_pack("{sss{sisssi}}", "janus", "error", "error",
+		"code", JANUS_ZEROMQ_ERROR_OVERLOADED, "reason", reason, "retry_after", wait);
+	size_t tlen = 0;
+	const char *transaction = NULL;
+	if(codec == janus_zeromq_codec_json)
+		transaction = janus_zeromq_json_peek(zmq_msg_data(&request->message),
+			zmq_msg_size(&request->message), "transaction", &tlen);
+	if(transaction != NULL)
+		json_object_set_new(error, "transaction", json_stringn(transaction, tlen));
+	janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+	janus_zeromq_encode(codec, error, buffer);
+	json_decref(error);
+	/* Retries that come too early get the same rejection */
+	janus_zeromq_idempotency_track(request, buffer, (gint64)wait * 1000);
+	if(janus_zeromq_send(request->admin, client, buffer) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_ERR, "Error sending ZeroMQ %smessage: %s\n", request->admin ? "admin " : "", zmq_strerror(errno));
+	zmq_msg_close(&request->message);
+	janus_zeromq_client_unref(client);
+	g_free(request);
+	return FALSE;
+}
+
+/* Fair scheduling: queues a request until it's the turn of the peer */
+static void janus_zeromq_fair_enqueue(janus_zeromq_request *request) {
+	janus_zeromq_client *client = request->client;
+	if(client->weight == 0) {
+		/* Look for a weight for either the identity of the peer, or its address */
+		gpointer weight = NULL;
+		char identity[256];
+		memcpy(identity, client->envelope.identity, client->envelope.identity_len);
+		identity[client->envelope.identity_len] = '\0';
+		const char *peer_address = zmq_msg_gets(&request->message, "Peer-Address");
+		if(fair_weights != NULL && (weight = g_hash_table_lookup(fair_weights, identity)) == NULL && peer_address != NULL)
+			weight = g_hash_table_lookup(fair_weights, peer_address);
+		client->weight = weight ? GPOINTER_TO_UINT(weight) : 1;
+	}
+	g_queue_push_tail(&client->pending, request);
+	requests_pending++;
+	if(!client->scheduled) {
+		/* The list of peers with pending requests holds a reference */
+		client->scheduled = TRUE;
+		client->deficit = 0;
+		janus_zeromq_client_ref(client);
+		g_queue_push_tail(fair_peers, client);
+	}
+}
+
+/* Fair scheduling: dispatches pending requests with deficit round robin,
+ * as long as there's room in the worker queues */
+static void janus_zeromq_fair_schedule(void) {
+	while(!g_queue_is_empty(fair_peers) && (guint)g_atomic_int_get(&requests_queued) < fair_window) {
+		janus_zeromq_client *client = g_queue_pop_head(fair_peers);
+		/* A peer we stopped at because the window was full already got its quantum */
+		if(!fair_resume)
+			client->deficit += JANUS_ZEROMQ_FAIR_QUANTUM * client->weight;
+		fair_resume = FALSE;
+		gboolean full = FALSE;
+		while(!g_queue_is_empty(&client->pending)) {
+			janus_zeromq_request *request = g_queue_peek_head(&client->pending);
+			gint size = zmq_msg_size(&request->message);
+			if(size > client->deficit)
+				break;
+			if((guint)g_atomic_int_get(&requests_queued) >= fair_window) {
+				full = TRUE;
+				break;
+			}
+			g_queue_pop_head(&client->pending);
+			requests_pending--;
+			client->deficit -= size;
+			janus_zeromq_dispatch(request);
+		}
+		if(g_queue_is_empty(&client->pending)) {
+			/* Nothing left for this peer, it doesn't keep its deficit */
+			client->scheduled = FALSE;
+			client->deficit = 0;
+			janus_zeromq_client_unref(client);
+		} else if(full) {
+			/* Resume from this same peer as soon as there's room */
+			g_queue_push_head(fair_peers, client);
+			fair_resume = TRUE;
+		} else {
+			/* Its quantum is used up, move to the next peer */
+			g_queue_push_tail(fair_peers, client);
+		}
+	}
+}
+
+/* Helper to read the requests available on one of the API sockets, and
+ * dispatch them: we stop after a few, to avoid starving the other sockets */
+static void janus_zeromq_read(gboolean admin) {
+	void *socket = admin ? zmq_admin_socket : zmq_janus_socket;
+	int type = admin ? admin_socket_type : janus_socket_type;
 	zmq_msg_t message;
-	
-	while(!g_atomic_int_get(&stopping)) {
+	janus_zeromq_envelope envelope;
+	int count = 0;
+	while(count < JANUS_ZEROMQ_READ_BUDGET) {
 		/* Initialize message */
 		zmq_msg_init(&message);
 		
-		/* Receive message (timeout is already set) */
-		int size = zmq_msg_recv(&message, zmq_socket, 0);
+		/* Receive message */
+		int size = janus_zeromq_recv(socket, type, &message, &envelope);
 		if(size < 0) {
-			if(errno == EAGAIN || errno == EINTR) {
-				/* Timeout or interrupt, continue */
-				zmq_msg_close(&message);
-				continue;
-			}
-			JANUS_LOG(LOG_ERR, "Error receiving ZeroMQ message: %s\n", zmq_strerror(errno));
 			zmq_msg_close(&message);
-			continue;
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				JANUS_LOG(LOG_ERR, "Error receiving ZeroMQ %smessage: %s\n", admin ? "admin " : "", zmq_strerror(errno));
+			break;
 		}
+		count++;
 		
-		/* Process message */
-		char *payload = g_malloc0(size + 1);
-		memcpy(payload, zmq_msg_data(&message), size);
-		payload[size] = '\0';
-		
-		JANUS_LOG(LOG_HUGE, "Received ZeroMQ message: %s\n", payload);
-		
-		/* Parse JSON */
-		json_error_t error;
-		json_t *root = json_loads(payload, 0, &error);
-		g_free(payload);
+		/* Hand the request to a worker (or process it here if we have none) */
+		janus_zeromq_request *request = g_malloc(sizeof(janus_zeromq_request));
+		request->admin = admin;
+		request->received = g_get_monotonic_time();
+		janus_zeromq_stats_get()->api[admin].bytes_in += size;
+		request->client = janus_zeromq_client_get(admin, &envelope);
+		if(monitor) {
+			/* Keep track of the connection the peer is using, which may be a new one */
+			request->client->fd = zmq_msg_get(&message, ZMQ_SRCFD);
+			request->client->disconnected = 0;
+		}
+		/* Check which codec the peer is using, if we need to guess */
+		janus_zeromq_codec codec = admin ? admin_codec : janus_codec;
+		if(codec == janus_zeromq_codec_auto)
+			codec = janus_zeromq_is_msgpack(zmq_msg_data(&message), zmq_msg_size(&message)) ?
+				janus_zeromq_codec_msgpack : janus_zeromq_codec_json;
+		g_atomic_int_set(&request->client->codec, codec);
+		/* We don't copy the payload, we just move the frame to the request */
+		zmq_msg_init(&request->message);
+		zmq_msg_move(&request->message, &message);
 		zmq_msg_close(&message);
-		
-		if(!root) {
-			JANUS_LOG(LOG_ERR, "JSON parsing error: %s\n", error.text);
-			/* Send error response */
-			char *error_response = "{\"janus\":\"error\",\"error\":{\"code\":498,\"reason\":\"Invalid JSON\"}}";
-			zmq_send(zmq_socket, error_response, strlen(error_response), 0);
+		request->lane = janus_zeromq_classify(request);
+		if(!janus_zeromq_idempotency_check(request))
+			continue;
+		if(!janus_zeromq_admit(request))
+			continue;
+		janus_zeromq_idempotency_track(request, NULL, idempotency_ttl);
+		if(fair && request->lane != JANUS_ZEROMQ_LANE_PRIORITY) {
+			/* Wait for the turn of the peer */
+			janus_zeromq_fair_enqueue(request);
 			continue;
 		}
+		janus_zeromq_dispatch(request);
 		
-		/* Create a transport session - Note: ownership transfers to gateway */
-		janus_transport_session *transport_session = g_malloc0(sizeof(janus_transport_session));
-		transport_session->transport_p = &janus_zeromq_transport;
-		
-		/* Pass to gateway - gateway takes ownership of both root and transport_session */
-		gateway->incoming_request(&janus_zeromq_transport, transport_session, NULL, FALSE, root, NULL);
-		/* Note: Do not free transport_session or root here - gateway is responsible */
+		/* A REP socket won't give us anything else until we reply */
+		if(type == ZMQ_REP)
+			break;
 	}
-	
-	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ thread...\n");
-	return NULL;
 }
 
-/* Thread for handling Admin API messages */
-static void *janus_zeromq_admin_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "Joining ZeroMQ Admin thread...\n");
+/* Thread owning all the sockets: we wait for incoming requests on the
+ * Janus and Admin API sockets, outgoing messages queued in the mailbox,
+ * and a message on the control socket telling us to stop */
+static void *janus_zeromq_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "Joining ZeroMQ thread...\n");
+	janus_zeromq_thread_pin(thread_affinity);
 	
-	zmq_msg_t message;
+	zmq_pollitem_t items[6];
+	int num = 0, control = -1, wakeup = -1, admin = -1, janus = -1, admin_monitor = -1, janus_monitor = -1;
+	items[num] = (zmq_pollitem_t){ .socket = zmq_control_socket, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+	control = num++;
+	items[num] = (zmq_pollitem_t){ .socket = NULL, .fd = mailbox.fd, .events = ZMQ_POLLIN, .revents = 0 };
+	wakeup = num++;
+	if(zmq_admin_socket != NULL) {
+		items[num] = (zmq_pollitem_t){ .socket = zmq_admin_socket, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+		admin = num++;
+	}
+	if(zmq_janus_socket != NULL) {
+		items[num] = (zmq_pollitem_t){ .socket = zmq_janus_socket, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+		janus = num++;
+	}
+	if(zmq_admin_monitor != NULL) {
+		items[num] = (zmq_pollitem_t){ .socket = zmq_admin_monitor, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+		admin_monitor = num++;
+	}
+	if(zmq_janus_monitor != NULL) {
+		items[num] = (zmq_pollitem_t){ .socket = zmq_janus_monitor, .fd = 0, .events = ZMQ_POLLIN, .revents = 0 };
+		janus_monitor = num++;
+	}
 	
+	gint64 last_sweep = g_get_monotonic_time();
+	long timeout = JANUS_ZEROMQ_PEERS_SWEEP_INTERVAL/1000;
 	while(!g_atomic_int_get(&stopping)) {
-		/* Initialize message */
-		zmq_msg_init(&message);
-		
-		/* Receive message (timeout is already set) */
-		int size = zmq_msg_recv(&message, zmq_admin_socket, 0);
-		if(size < 0) {
-			if(errno == EAGAIN || errno == EINTR) {
-				/* Timeout or interrupt, continue */
-				zmq_msg_close(&message);
+		int res = zmq_poll(items, num, timeout);
+		if(res < 0) {
+			if(errno == EINTR)
 				continue;
-			}
-			JANUS_LOG(LOG_ERR, "Error receiving ZeroMQ admin message: %s\n", zmq_strerror(errno));
-			zmq_msg_close(&message);
-			continue;
+			JANUS_LOG(LOG_ERR, "Error polling ZeroMQ sockets: %s\n", zmq_strerror(errno));
+			break;
 		}
-		
-		/* Process message */
-		char *payload = g_malloc0(size + 1);
-		memcpy(payload, zmq_msg_data(&message), size);
-		payload[size] = '\0';
-		
-		JANUS_LOG(LOG_HUGE, "Received ZeroMQ admin message: %s\n", payload);
-		
-		/* Parse JSON */
-		json_error_t error;
-		json_t *root = json_loads(payload, 0, &error);
-		g_free(payload);
-		zmq_msg_close(&message);
-		
-		if(!root) {
-			JANUS_LOG(LOG_ERR, "JSON parsing error: %s\n", error.text);
-			/* Send error response */
-			char *error_response = "{\"janus\":\"error\",\"error\":{\"code\":498,\"reason\":\"Invalid JSON\"}}";
-			zmq_send(zmq_admin_socket, error_response, strlen(error_response), 0);
-			continue;
+		if(items[control].revents & ZMQ_POLLIN) {
+			/* We're shutting down */
+			break;
 		}
-		
-		/* Create a transport session - Note: ownership transfers to gateway */
-		janus_transport_session *transport_session = g_malloc0(sizeof(janus_transport_session));
-		transport_session->transport_p = &janus_zeromq_transport;
-		
-		/* Pass to gateway - gateway takes ownership of both root and transport_session */
-		gateway->incoming_request(&janus_zeromq_transport, transport_session, NULL, TRUE, root, NULL);
-		/* Note: Do not free transport_session or root here - gateway is responsible */
+		/* Send whatever was queued first, which in REP mode also makes the sockets readable again */
+		if(items[wakeup].revents & ZMQ_POLLIN)
+			janus_zeromq_mailbox_flush();
+		/* Find out about connections that went away before reading from them */
+		if(admin_monitor != -1 && (items[admin_monitor].revents & ZMQ_POLLIN))
+			janus_zeromq_monitor_read(TRUE);
+		if(janus_monitor != -1 && (items[janus_monitor].revents & ZMQ_POLLIN))
+			janus_zeromq_monitor_read(FALSE);
+		/* The Admin API has priority over the Janus API */
+		if(admin != -1 && (items[admin].revents & ZMQ_POLLIN))
+			janus_zeromq_read(TRUE);
+		if(janus != -1 && (items[janus].revents & ZMQ_POLLIN))
+			janus_zeromq_read(FALSE);
+		/* Dispatch as many pending requests as the workers can take */
+		if(fair)
+			janus_zeromq_fair_schedule();
+		/* Every now and then, get rid of the peers we're not hearing from anymore */
+		gint64 now = g_get_monotonic_time();
+		if(now - last_sweep >= JANUS_ZEROMQ_PEERS_SWEEP_INTERVAL) {
+			janus_zeromq_clients_sweep();
+			janus_zeromq_idempotency_expire();
+			last_sweep = now;
+		}
+		/* Send the batches whose window expired, and figure out when to wake up next */
+		timeout = (last_sweep + JANUS_ZEROMQ_PEERS_SWEEP_INTERVAL - now) / 1000;
+		long next_batch = janus_zeromq_batch_timers_check();
+		if(next_batch >= 0 && next_batch < timeout)
+			timeout = next_batch;
+		/* Release the peers that disconnected and didn't come back */
+		long next_gone = janus_zeromq_gone_timers_check();
+		if(next_gone >= 0 && next_gone < timeout)
+			timeout = next_gone;
+		/* Try again sending the chunks peers couldn't take */
+		long next_chunks = janus_zeromq_chunks_retry();
+		if(next_chunks >= 0 && next_chunks < timeout)
+			timeout = next_chunks;
 	}
 	
-	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ Admin thread...\n");
+	JANUS_LOG(LOG_VERB, "Leaving ZeroMQ thread...\n");
 	return NULL;
 }
 
 /* Send message */
 int janus_zeromq_send_message(janus_transport_session *transport, void *request_id, gboolean admin, json_t *message) {
-	if(message == NULL)
+	if(message == NULL) {
+		g_free(request_id);
 		return -1;
-	if(g_atomic_int_get(&stopping))
+	}
+	if(g_atomic_int_get(&stopping)) {
+		g_free(request_id);
 		return -1;
+	}
 		
-	/* Serialize message */
-	char *payload = json_dumps(message, JSON_COMPACT);
-	if(payload == NULL) {
-		JANUS_LOG(LOG_ERR, "Failed to serialize JSON message\n");
+	if((admin && zmq_admin_socket == NULL) || (!admin && zmq_janus_socket == NULL)) {
+		/* This API is not enabled */
+		g_free(request_id);
 		json_decref(message);
 		return -1;
 	}
+		
+	/* Replies to requests come with the request ID we passed to the core */
+	gboolean event = (!admin && request_id == NULL);
+	janus_zeromq_request_id request = { 0 };
+	if(request_id != NULL) {
+		/* The reply is timed by the thread owning the sockets, when it picks it up */
+		request = *(janus_zeromq_request_id *)request_id;
+		g_free(request_id);
+		/* The core replies exactly once to each request we pass it, so this is
+		 * where we account for it, on the peer that sent it (events don't count) */
+		if(transport != NULL && transport->transport_data != NULL)
+			janus_zeromq_client_settle((janus_zeromq_client *)transport->transport_data, 1);
+	}
 	
-	JANUS_LOG(LOG_HUGE, "Sending ZeroMQ message: %s\n", payload);
-	
-	/* Send to appropriate socket */
-	void *socket = admin ? zmq_admin_socket : zmq_socket;
-	int ret = zmq_send(socket, payload, strlen(payload), 0);
+	/* Asynchronous events for a session are published, if we have a PUB socket */
+	json_t *session_id = json_object_get(message, "session_id");
+	if(event && zmq_publish_socket != NULL && json_is_integer(session_id) && json_integer_value(session_id) > 0) {
+		janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+		if(json_dump_callback(message, janus_zeromq_buffer_dump_cb, buffer, JSON_COMPACT) < 0 || buffer->len == 0) {
+			JANUS_LOG(LOG_ERR, "Failed to serialize event\n");
+			janus_zeromq_buffer_release(buffer);
+		} else {
+			janus_zeromq_queue_publication(json_integer_value(session_id), buffer);
+		}
+	}
+	if(event && janus_socket_type == ZMQ_REP) {
+		/* REP only allows replies to requests, events can't be sent there */
+		json_decref(message);
+		return zmq_publish_socket != NULL ? 0 : -1;
+	}
+		
+	/* Replies always go to the peer that sent the request, while in ROUTER mode
+	 * asynchronous events for a session go to the peer that currently owns it */
+	janus_zeromq_client *client = NULL;
+	if(event && janus_socket_type == ZMQ_ROUTER && json_is_integer(session_id))
+		client = janus_zeromq_session_get_owner(json_integer_value(session_id));
+	if(client == NULL && transport != NULL) {
+		client = (janus_zeromq_client *)transport->transport_data;
+		janus_zeromq_client_ref(client);
+	}
 	
-	free(payload);
+	/* Serialize message: we do this here, so that it doesn't happen in the socket
+	 * thread, and we do it in a recycled buffer, that ZeroMQ will send as it is */
+	janus_zeromq_buffer *buffer = janus_zeromq_buffer_get();
+	janus_zeromq_codec codec = client ? g_atomic_int_get(&client->codec) : janus_zeromq_codec_json;
+	json_t *transaction = json_object_get(message, "transaction");
+	/* If we're caching replies, we'll need the transaction later */
+	char *cache_transaction = (idempotency && json_is_string(transaction)) ? g_strdup(json_string_value(transaction)) : NULL;
+	int res = 0;
+	int type = admin ? admin_socket_type : janus_socket_type;
+	if(chunk_size > 0 && client != NULL && type == ZMQ_ROUTER && codec == janus_zeromq_codec_json) {
+		/* Serialize the reply in chunks, in case it turns out to be a large one */
+		janus_zeromq_chunker chunker = { .admin = admin, .client = client, .buffer = buffer, .stream = NULL, .request = request };
+		res = json_dump_callback(message, janus_zeromq_chunker_dump_cb, &chunker, JSON_COMPACT);
+		buffer = chunker.buffer;
+		if(chunker.stream != NULL) {
+			/* It did: chunked replies are not cached */
+			json_decref(message);
+			g_free(cache_transaction);
+			if(res < 0 || janus_zeromq_queue_chunk(&chunker, buffer, TRUE) < 0) {
+				JANUS_LOG(LOG_ERR, "Failed to send chunked reply %u\n", chunker.stream->id);
+				if(res < 0)
+					janus_zeromq_buffer_release(buffer);
+				res = -1;
+			}
+			janus_zeromq_stream_unref(chunker.stream);
+			janus_zeromq_client_unref(client);
+			return res < 0 ? -1 : 0;
+		}
+	} else {
+		res = janus_zeromq_encode(codec, message, buffer);
+	}
 	json_decref(message);
-	
-	if(ret < 0) {
-		JANUS_LOG(LOG_ERR, "Error sending ZeroMQ message: %s\n", zmq_strerror(errno));
+	if(res < 0 || buffer->len == 0) {
+		JANUS_LOG(LOG_ERR, "Failed to serialize message\n");
+		janus_zeromq_buffer_release(buffer);
+		janus_zeromq_client_unref(client);
+		g_free(cache_transaction);
 		return -1;
 	}
 	
+	/* Queue the message for the thread owning the socket */
+	janus_zeromq_queue_buffer(admin, client, buffer, cache_transaction, &request);
+	janus_zeromq_client_unref(client);
+	
 	return 0;
 }
 
 /* Session callbacks */
 void janus_zeromq_session_created(janus_transport_session *transport, guint64 session_id) {
-	/* We don't need to do anything here */
+	if(transport == NULL || session_id == 0 || g_atomic_int_get(&stopping))
+		return;
+	JANUS_LOG(LOG_VERB, "Session created (%"SCNu64"), tracking it\n", session_id);
+	janus_zeromq_session *session = g_malloc0(sizeof(janus_zeromq_session));
+	session->session_id = session_id;
+	janus_zeromq_session_set_owner(session, transport);
+	janus_zeromq_sessions_stripe *stripe = janus_zeromq_sessions_stripe_for(session_id);
+	janus_mutex_lock(&stripe->mutex);
+	g_hash_table_replace(stripe->sessions, &session->session_id, session);
+	janus_mutex_unlock(&stripe->mutex);
 }
 
 void janus_zeromq_session_over(janus_transport_session *transport, guint64 session_id, gboolean timeout, gboolean claimed) {
-	/* We don't need to do anything here */
+	if(session_id == 0 || g_atomic_int_get(&stopping))
+		return;
+	JANUS_LOG(LOG_VERB, "Session %s (%"SCNu64"), no longer tracking it\n",
+		timeout ? "has timed out" : (claimed ? "was claimed" : "is over"), session_id);
+	janus_zeromq_sessions_stripe *stripe = janus_zeromq_sessions_stripe_for(session_id);
+	janus_mutex_lock(&stripe->mutex);
+	janus_zeromq_session *session = g_hash_table_lookup(stripe->sessions, &session_id);
+	/* If the session was claimed, a claim moved it to another peer (or to
+	 * another transport plugin) already: only forget about it if it's still ours */
+	if(session != NULL && (!claimed || (session->client != NULL && &session->client->transport == transport)))
+		g_hash_table_remove(stripe->sessions, &session_id);
+	janus_mutex_unlock(&stripe->mutex);
 }
 
 void janus_zeromq_session_claimed(janus_transport_session *transport, guint64 session_id) {
-	/* We don't need to do anything here */
+	if(transport == NULL || session_id == 0 || g_atomic_int_get(&stopping))
+		return;
+	JANUS_LOG(LOG_VERB, "Session claimed (%"SCNu64"), updating its owner\n", session_id);
+	janus_zeromq_sessions_stripe *stripe = janus_zeromq_sessions_stripe_for(session_id);
+	janus_mutex_lock(&stripe->mutex);
+	janus_zeromq_session *session = g_hash_table_lookup(stripe->sessions, &session_id);
+	if(session == NULL) {
+		/* Claimed from another transport plugin */
+		session = g_malloc0(sizeof(janus_zeromq_session));
+		session->session_id = session_id;
+		g_hash_table_replace(stripe->sessions, &session->session_id, session);
+	}
+	janus_zeromq_session_set_owner(session, transport);
+	janus_mutex_unlock(&stripe->mutex);
 }
 
 /* Query transport */
@@ -504,6 +3185,15 @@ json_t *janus_zeromq_query_transport(json_t *request) {
 		char bind_address[256];
 		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", address, port);
 		json_object_set_new(info, "janus_api_address", json_string(bind_address));
+		if(endpoints != NULL) {
+			json_t *list = json_array();
+			int i = 0;
+			for(i = 0; endpoints[i] != NULL; i++)
+				json_array_append_new(list, json_string(endpoints[i]));
+			json_object_set_new(info, "janus_api_endpoints", list);
+		}
+		json_object_set_new(info, "janus_api_mode", json_string(janus_socket_type == ZMQ_ROUTER ? "router" : "rep"));
+		json_object_set_new(info, "janus_api_codec", json_string(janus_zeromq_codec_str(janus_codec)));
 	} else {
 		json_object_set_new(info, "janus_api_enabled", json_false());
 	}
@@ -513,9 +3203,70 @@ json_t *janus_zeromq_query_transport(json_t *request) {
 		char bind_address[256];
 		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", admin_address, admin_port);
 		json_object_set_new(info, "admin_api_address", json_string(bind_address));
+		if(admin_endpoints != NULL) {
+			json_t *list = json_array();
+			int i = 0;
+			for(i = 0; admin_endpoints[i] != NULL; i++)
+				json_array_append_new(list, json_string(admin_endpoints[i]));
+			json_object_set_new(info, "admin_api_endpoints", list);
+		}
+		json_object_set_new(info, "admin_api_mode", json_string(admin_socket_type == ZMQ_ROUTER ? "router" : "rep"));
+		json_object_set_new(info, "admin_api_codec", json_string(janus_zeromq_codec_str(admin_codec)));
 	} else {
 		json_object_set_new(info, "admin_api_enabled", json_false());
 	}
+	if(zmq_publish_socket != NULL) {
+		char bind_address[256];
+		g_snprintf(bind_address, sizeof(bind_address), "%s:%d", publish_address, publish_port);
+		json_object_set_new(info, "publish_address", json_string(bind_address));
+		json_object_set_new(info, "events_published", json_integer(g_atomic_int_get(&events_published)));
+	}
+	json_object_set_new(info, "workers", json_integer(workers_num));
+	json_object_set_new(info, "max_inflight", json_integer(max_inflight));
+	if(queue_high_watermark > 0) {
+		json_object_set_new(info, "queue_high_watermark", json_integer(queue_high_watermark));
+		json_object_set_new(info, "queue_low_watermark", json_integer(queue_low_watermark));
+	}
+	json_object_set_new(info, "requests_queued", json_integer(g_atomic_int_get(&requests_queued)));
+	json_object_set_new(info, "requests_shed", json_integer(g_atomic_int_get(&requests_shed)));
+	json_object_set_new(info, "messages_dropped", json_integer(g_atomic_int_get(&messages_dropped)));
+	json_object_set_new(info, "monitor", monitor ? json_true() : json_false());
+	if(monitor)
+		json_object_set_new(info, "disconnect_grace", json_integer(disconnect_grace/G_USEC_PER_SEC));
+	if(heartbeat_interval > 0) {
+		json_object_set_new(info, "heartbeat_interval", json_integer(heartbeat_interval));
+		json_object_set_new(info, "heartbeat_timeout", json_integer(heartbeat_timeout));
+	}
+	json_object_set_new(info, "priority_budget", json_integer(priority_budget));
+	json_object_set_new(info, "idempotency", idempotency ? json_true() : json_false());
+	if(idempotency) {
+		json_object_set_new(info, "idempotency_size", json_integer(idempotency_size));
+		json_object_set_new(info, "idempotency_ttl", json_integer(idempotency_ttl/G_USEC_PER_SEC));
+		json_object_set_new(info, "requests_retried", json_integer(g_atomic_int_get(&requests_retried)));
+	}
+	json_object_set_new(info, "fair", fair ? json_true() : json_false());
+	if(fair)
+		json_object_set_new(info, "fair_window", json_integer(fair_window));
+	json_object_set_new(info, "batching", batching ? json_true() : json_false());
+	if(batching) {
+		json_object_set_new(info, "batch_size", json_integer(batch_size));
+		json_object_set_new(info, "batch_max", json_integer(batch_max));
+		json_object_set_new(info, "batch_window", json_integer(batch_window/1000));
+	}
+	if(chunk_size > 0) {
+		json_object_set_new(info, "chunk_size", json_integer(chunk_size));
+		json_object_set_new(info, "chunk_window", json_integer(chunk_window));
+		json_object_set_new(info, "chunk_timeout", json_integer(chunk_timeout/1000));
+		json_object_set_new(info, "chunked_replies", json_integer(g_atomic_int_get(&chunked_replies)));
+	}
+	guint i = 0, num_sessions = 0;
+	for(i = 0; i < JANUS_ZEROMQ_SESSIONS_STRIPES; i++) {
+		janus_mutex_lock(&sessions[i].mutex);
+		num_sessions += g_hash_table_size(sessions[i].sessions);
+		janus_mutex_unlock(&sessions[i].mutex);
+	}
+	json_object_set_new(info, "sessions", json_integer(num_sessions));
+	json_object_set_new(info, "stats", janus_zeromq_stats_summary());
 	
 	return info;
 }
@@ -526,40 +3277,181 @@ void janus_zeromq_destroy(void) {
 		return;
 	g_atomic_int_set(&stopping, 1);
 
-	/* Wait for threads to stop */
+	/* Wake the ZeroMQ thread up, and wait for it to stop */
 	if(zeromq_thread != NULL) {
+		void *control = zmq_socket(zmq_context, ZMQ_PAIR);
+		if(control != NULL) {
+			if(zmq_connect(control, JANUS_ZEROMQ_CONTROL_ENDPOINT) == 0)
+				zmq_send(control, "stop", 4, 0);
+			zmq_close(control);
+		}
 		g_thread_join(zeromq_thread);
 		zeromq_thread = NULL;
 	}
-	if(zeromq_admin_thread != NULL) {
-		g_thread_join(zeromq_admin_thread);
-		zeromq_admin_thread = NULL;
+
+	/* Stop the workers, and get rid of the requests they never processed */
+	if(workers != NULL) {
+		guint i = 0;
+		for(i = 0; i < workers_num; i++) {
+			if(workers[i] != NULL) {
+				exit_request.lane = JANUS_ZEROMQ_LANE_NORMAL;
+				janus_zeromq_worker_queue_push(&worker_queues[i], &exit_request);
+				g_thread_join(workers[i]);
+			}
+			guint lane = 0;
+			for(lane = 0; lane < JANUS_ZEROMQ_LANES; lane++) {
+				janus_zeromq_request *request = NULL;
+				while((request = g_queue_pop_head(&worker_queues[i].lanes[lane])) != NULL) {
+					if(request == &exit_request)
+						continue;
+					zmq_msg_close(&request->message);
+					janus_zeromq_client_unref(request->client);
+					g_free(request);
+				}
+			}
+			janus_mutex_clear(&worker_queues[i].mutex);
+			janus_condition_clear(&worker_queues[i].cond);
+		}
+		g_free(workers);
+		workers = NULL;
+		g_free(worker_queues);
+		worker_queues = NULL;
+	}
+	workers_num = 0;
+
+	/* Get rid of the batches that were never sent */
+	if(batch_timers != NULL) {
+		janus_zeromq_batch_timer *timer = NULL;
+		while((timer = g_queue_pop_head(batch_timers)) != NULL) {
+			janus_zeromq_buffer_release(timer->client->batch);
+			timer->client->batch = NULL;
+			janus_zeromq_client_unref(timer->client);
+			g_free(timer);
+		}
+		g_queue_free(batch_timers);
+		batch_timers = NULL;
+	}
+
+	/* Get rid of the chunks that were never sent, which aborts their replies */
+	if(chunks_blocked != NULL) {
+		janus_zeromq_outgoing *msg = NULL;
+		while((msg = g_queue_pop_head(chunks_blocked)) != NULL)
+			janus_zeromq_outgoing_free(msg);
+		g_queue_free(chunks_blocked);
+		chunks_blocked = NULL;
+	}
+	chunk_size = 0;
+
+	/* Get rid of the requests that were never dispatched */
+	if(fair_peers != NULL) {
+		janus_zeromq_client *client = NULL;
+		while((client = g_queue_pop_head(fair_peers)) != NULL) {
+			janus_zeromq_request *request = NULL;
+			while((request = g_queue_pop_head(&client->pending)) != NULL) {
+				zmq_msg_close(&request->message);
+				janus_zeromq_client_unref(request->client);
+				g_free(request);
+			}
+			client->scheduled = FALSE;
+			janus_zeromq_client_unref(client);
+		}
+		g_queue_free(fair_peers);
+		fair_peers = NULL;
+	}
+	requests_pending = 0;
+	fair_resume = FALSE;
+
+	/* Get rid of the idempotency cache */
+	if(idempotency_queue != NULL)
+		g_queue_free(idempotency_queue);
+	idempotency_queue = NULL;
+	if(idempotency_cache != NULL)
+		g_hash_table_destroy(idempotency_cache);
+	idempotency_cache = NULL;
+	idempotency = FALSE;
+	fair = FALSE;
+	if(fair_weights != NULL)
+		g_hash_table_destroy(fair_weights);
+	fair_weights = NULL;
+
+	/* Forget about the peers that disconnected */
+	if(gone_timers != NULL) {
+		janus_zeromq_gone_timer *timer = NULL;
+		while((timer = g_queue_pop_head(gone_timers)) != NULL) {
+			janus_zeromq_client_unref(timer->client);
+			g_free(timer);
+		}
+		g_queue_free(gone_timers);
+		gone_timers = NULL;
 	}
 
+	/* Get rid of the messages that were never sent */
+	if(mailbox.fd >= 0)
+		janus_zeromq_mailbox_destroy(&mailbox);
+
 	/* Close sockets */
-	if(zmq_socket != NULL) {
-		zmq_close(zmq_socket);
-		zmq_socket = NULL;
+	if(zmq_control_socket != NULL) {
+		zmq_close(zmq_control_socket);
+		zmq_control_socket = NULL;
+	}
+	if(zmq_janus_monitor != NULL) {
+		zmq_socket_monitor(zmq_janus_socket, NULL, 0);
+		zmq_close(zmq_janus_monitor);
+		zmq_janus_monitor = NULL;
+	}
+	if(zmq_admin_monitor != NULL) {
+		zmq_socket_monitor(zmq_admin_socket, NULL, 0);
+		zmq_close(zmq_admin_monitor);
+		zmq_admin_monitor = NULL;
+	}
+	if(zmq_janus_socket != NULL) {
+		zmq_close(zmq_janus_socket);
+		zmq_janus_socket = NULL;
 	}
 	if(zmq_admin_socket != NULL) {
 		zmq_close(zmq_admin_socket);
 		zmq_admin_socket = NULL;
 	}
+	if(zmq_publish_socket != NULL) {
+		zmq_close(zmq_publish_socket);
+		zmq_publish_socket = NULL;
+	}
 
 	/* Destroy context */
 	if(zmq_context != NULL) {
-		zmq_ctx_destroy(zmq_context);
+		janus_zeromq_context_unref(JANUS_ZEROMQ_NAME);
 		zmq_context = NULL;
 	}
+	g_free((char *)context_settings.io_affinity);
+	g_free((char *)context_settings.io_sched_policy);
+	memset(&context_settings, 0, sizeof(context_settings));
+	g_free(thread_affinity);
+	thread_affinity = NULL;
+	/* Now that ZeroMQ released all the frames, we can get rid of the recycled buffers */
+	janus_zeromq_pool_cleanup(buffers_pool, (GDestroyNotify)janus_zeromq_buffer_free);
 
 	/* Cleanup */
-	janus_mutex_lock(&sessions_mutex);
-	g_hash_table_destroy(sessions);
-	sessions = NULL;
-	janus_mutex_unlock(&sessions_mutex);
+	guint i = 0;
+	for(i = 0; i < JANUS_ZEROMQ_SESSIONS_STRIPES; i++) {
+		janus_mutex_lock(&sessions[i].mutex);
+		g_hash_table_destroy(sessions[i].sessions);
+		sessions[i].sessions = NULL;
+		janus_mutex_unlock(&sessions[i].mutex);
+	}
+	g_hash_table_destroy(janus_peers);
+	janus_peers = NULL;
+	g_hash_table_destroy(admin_peers);
+	admin_peers = NULL;
+	janus_zeromq_pool_cleanup(clients_pool, (GDestroyNotify)g_free);
 
 	g_free(address);
 	g_free(admin_address);
+	g_free(publish_address);
+	publish_address = NULL;
+	g_strfreev(endpoints);
+	endpoints = NULL;
+	g_strfreev(admin_endpoints);
+	admin_endpoints = NULL;
 
 	g_atomic_int_set(&initialized, 0);
 	g_atomic_int_set(&stopping, 0);